@@ -0,0 +1,49 @@
+#!/bin/sh
+# Time myps scans against synthetic /proc trees of increasing size.
+#
+# usage: bench.sh [pids ...]
+#
+# Environment: BENCH_DIR, BENCH_GROUPS, BENCH_CMDLEN, BENCH_KTHREADS,
+# and MYPS/MKFAKEPROC to override the binaries.
+
+MYPS=${MYPS:-./myps}
+MKFAKEPROC=${MKFAKEPROC:-bench/mkfakeproc}
+DIR=${BENCH_DIR:-/tmp/myps-bench}
+NGROUPS=${BENCH_GROUPS:-500}
+CMDLEN=${BENCH_CMDLEN:-128}
+KTHREADS=${BENCH_KTHREADS:-200}
+JOBS=$(nproc 2>/dev/null || echo 4)
+
+# A match with many patterns to exercise the matcher
+PATTERNS="svc1 svc2 svc3 svc5 svc8 svc13 svc21 svc34 svc55 svc89 svc144 svc233"
+
+# Pull the phase times out of the -S output
+phases() {
+    $MYPS --proc-root $DIR -S "$@" 2>&1 >/dev/null |
+	awk '/ list / {
+	    for (i = 2; i < NF; i += 3)
+		ms[$i] = $(i + 1)
+	    printf "%8s %8s %8s %8s %8s %8s\n", ms["list"], ms["scan"], ms["group"],
+		   ms["sort"], ms["match"], ms["print"]
+	}'
+}
+
+printf "%7s %-12s %8s %8s %8s %8s %8s %8s  (ms)\n" \
+       pids mode list scan group sort match print
+
+for pids in ${*:-10000 50000}; do
+    rm -rf $DIR
+    $MKFAKEPROC -p $pids -g $NGROUPS -l $CMDLEN -k $KTHREADS $DIR || exit 1
+
+    $MYPS --proc-root $DIR > /dev/null # warm up
+
+    printf "%7d %-12s %s\n" $pids "serial" "$(phases)"
+    printf "%7d %-12s %s\n" $pids "io_uring" "$(phases -u)"
+    printf "%7d %-12s %s\n" $pids "-j $JOBS" "$(phases -j $JOBS)"
+    printf "%7d %-12s %s\n" $pids "sort cpu" "$(phases -s cpu)"
+    printf "%7d %-12s %s\n" $pids "match" "$(phases $PATTERNS)"
+    printf "%7d %-12s %s\n" $pids "match -w" "$(phases -w $PATTERNS)"
+    printf "%7d %-12s %s\n" $pids "match -r" "$(phases -r $PATTERNS)"
+done
+
+rm -rf $DIR
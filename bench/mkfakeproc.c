@@ -0,0 +1,152 @@
+/* mkfakeproc - build a synthetic /proc tree for benchmarking myps
+ *
+ * Only the files myps reads are created: <pid>/stat and <pid>/cmdline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/* From linux/sched.h */
+#define PF_KTHREAD 0x00200000
+
+static unsigned long long seed = 0x9e3779b97f4a7c15ull;
+
+/* xorshift64, good enough and repeatable */
+static unsigned long long rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static void write_file(int dirfd, const char *name, const char *buf, int len)
+{
+	int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, buf, len) != len) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+}
+
+static void make_pid(int rootfd, int pid, int ppid, int grp, int cmdlen, int kthread)
+{
+	char name[16], comm[16], buf[0x1001];
+	int n;
+
+	snprintf(name, sizeof(name), "%d", pid);
+	if (mkdirat(rootfd, name, 0755) && errno != EEXIST) {
+		perror(name);
+		exit(1);
+	}
+	int dirfd = openat(rootfd, name, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		perror(name);
+		exit(1);
+	}
+
+	if (kthread)
+		snprintf(comm, sizeof(comm), "kworker/%d", pid % 64);
+	else
+		snprintf(comm, sizeof(comm), "svc%d", grp);
+
+	/* All 52 fields, see proc(5) */
+	unsigned long long utime = rnd() % 100000, stime = rnd() % 10000;
+	unsigned long long start = 100 + pid * 3 + rnd() % 3;
+	unsigned long rss = kthread ? 0 : 100 + rnd() % 50000;
+	unsigned long vsize = rss * 4096 * 4;
+	unsigned flags = kthread ? PF_KTHREAD | 0x40 : 0x400000;
+	int threads = kthread ? 1 : 1 + rnd() % 16;
+	n = snprintf(buf, sizeof(buf),
+				 "%d (%s) S %d %d %d 0 -1 %u %llu 0 %llu 0 %llu %llu 0 0 20 0 %d 0 "
+				 "%llu %lu %lu 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 %d "
+				 "0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+				 pid, comm, ppid, pid, pid, flags, rnd() % 10000,
+				 rnd() % 100, utime, stime, threads, start, vsize, rss,
+				 (int)(rnd() % 64));
+	write_file(dirfd, "stat", buf, n);
+
+	/* cmdline: /usr/bin/svcN then NUL separated args up to cmdlen */
+	n = 0;
+	if (!kthread) {
+		n = snprintf(buf, sizeof(buf), "/usr/bin/svc%d", grp) + 1;
+		while (n < cmdlen && n < (int)sizeof(buf) - 16)
+			n += snprintf(buf + n, sizeof(buf) - n, "--opt%llu", rnd() % 1000) + 1;
+	}
+	write_file(dirfd, "cmdline", buf, n);
+
+	close(dirfd);
+}
+
+static void usage(int rc)
+{
+	fputs("usage: mkfakeproc [-p pids] [-g groups] [-l cmdlen] [-k kthreads] dir\n"
+		  "where: -p number of processes (default 10000)\n"
+		  "       -g number of distinct commands (default 100)\n"
+		  "       -l approximate cmdline length (default 64)\n"
+		  "       -k number of kernel threads (default 100)\n",
+		  stderr);
+	exit(rc);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, npids = 10000, ngroups = 100, cmdlen = 64, kthreads = 100;
+
+	while ((c = getopt(argc, argv, "g:hk:l:p:")) != EOF)
+		switch (c) {
+		case 'g':
+			ngroups = strtol(optarg, NULL, 0);
+			break;
+		case 'k':
+			kthreads = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			cmdlen = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			npids = strtol(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(1);
+		}
+
+	if (optind + 1 != argc || npids < 1 || ngroups < 1)
+		usage(1);
+
+	const char *root = argv[optind];
+	if (mkdir(root, 0755) && errno != EEXIST) {
+		perror(root);
+		exit(1);
+	}
+	int rootfd = open(root, O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0) {
+		perror(root);
+		exit(1);
+	}
+
+	/* pid 1 is init, 2 is kthreadd. Kernel threads come first like on
+	 * a real system.
+	 */
+	int pid = 1;
+	make_pid(rootfd, pid++, 0, 0, cmdlen, 0);
+	make_pid(rootfd, pid++, 0, 0, cmdlen, 1);
+	for (int i = 0; i < kthreads; ++i)
+		make_pid(rootfd, pid++, 2, 0, cmdlen, 1);
+	for (int i = 1; i < npids; ++i, ++pid) {
+		/* Skewed so a few groups are big, like real systems */
+		int grp = (rnd() % ngroups) * (rnd() % ngroups) / ngroups;
+		make_pid(rootfd, pid, 1 + rnd() % (pid - 1), grp, cmdlen, 0);
+	}
+
+	close(rootfd);
+	return 0;
+}
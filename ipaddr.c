@@ -46,6 +46,7 @@
 #define W_DOWN     (1 << 11)
 #define W_EXISTS   (1 << 12)
 #define W_TUNTAP   (1 << 13)
+#define W_ROUTE    (1 << 14)
 #define W_NO_VIRT  (1 << 15)
 
 #define VIRBR "virbr"
@@ -59,6 +60,13 @@
 #endif
 
 #if defined(__linux__)
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP 0x10000 /* the carrier, from linux/if.h */
+#endif
+
 /* Currently only used to copy ifnames */
 static void strlcpy(char *dst, const char *src, int dstlen)
 {
@@ -68,27 +76,493 @@ static void strlcpy(char *dst, const char *src, int dstlen)
 	*dst = 0;
 }
 
+/* Rather than a socket, ioctl, and sysfs read per interface per
+ * query, everything comes from one rtnetlink socket with a dump each
+ * of the links, the IPv4 addresses, and the routes. Each part is read
+ * the first time it is needed and kept.
+ */
+#define NL_LINKS  (1 << 0)
+#define NL_ADDRS  (1 << 1)
+#define NL_ROUTES (1 << 2)
+#define NL_FIB    (1 << 3) /* every IPv4 route, for -r */
+
+struct nl_link {
+	char name[IFNAMSIZ];
+	int index;
+	unsigned flags; /* IFF_*, IFF_LOWER_UP is the carrier */
+	unsigned char mac[ETHER_ADDR_LEN];
+};
+
+struct nl_addr {
+	char label[IFNAMSIZ]; /* eth0 or an alias like eth0:1 */
+	struct in_addr addr, mask;
+};
+
+/* Only the default routes, in kernel order */
+struct nl_gw {
+	int oif;
+	struct in_addr gw;
+};
+
+static struct {
+	int sock;
+	unsigned loaded;
+	struct nl_link *links; /* sorted by name */
+	int nlinks;
+	struct nl_addr *addrs;
+	int naddrs;
+	struct nl_gw *gws;
+	int ngws;
+} nl = { .sock = -1 };
+
+/* Grows arr by doubling, when n hits a power of 2 */
+static void *grow(void *arr, int n, size_t size)
+{
+	if (n && (n < 16 || (n & (n - 1))))
+		return arr;
+
+	arr = realloc(arr, (n ? n * 2 : 16) * size);
+	if (!arr)
+		err(1, "realloc");
+	return arr;
+}
+
+static void nl_link(struct nlmsghdr *nh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	int len = IFLA_PAYLOAD(nh);
+
+	nl.links = grow(nl.links, nl.nlinks, sizeof(struct nl_link));
+	struct nl_link *l = &nl.links[nl.nlinks++];
+	memset(l, 0, sizeof(struct nl_link));
+	l->index = ifi->ifi_index;
+	l->flags = ifi->ifi_flags;
+
+	for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			strlcpy(l->name, RTA_DATA(rta), IFNAMSIZ);
+			break;
+		case IFLA_ADDRESS: {
+			int n = RTA_PAYLOAD(rta);
+			memcpy(l->mac, RTA_DATA(rta), n < ETHER_ADDR_LEN ? n : ETHER_ADDR_LEN);
+			break;
+		}
+		}
+}
+
+static void nl_addr(struct nlmsghdr *nh)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	int len = IFA_PAYLOAD(nh);
+
+	if (ifa->ifa_family != AF_INET)
+		return;
+
+	nl.addrs = grow(nl.addrs, nl.naddrs, sizeof(struct nl_addr));
+	struct nl_addr *a = &nl.addrs[nl.naddrs++];
+	memset(a, 0, sizeof(struct nl_addr));
+	if (ifa->ifa_prefixlen)
+		a->mask.s_addr = htonl(~0u << (32 - ifa->ifa_prefixlen));
+
+	/* IFA_ADDRESS is the peer on point to point links, SIOCGIFADDR
+	 * gives the local address.
+	 */
+	int local = 0;
+	for (struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		switch (rta->rta_type) {
+		case IFA_LOCAL:
+			local = 1;
+			memcpy(&a->addr, RTA_DATA(rta), sizeof(struct in_addr));
+			break;
+		case IFA_ADDRESS:
+			if (!local)
+				memcpy(&a->addr, RTA_DATA(rta), sizeof(struct in_addr));
+			break;
+		case IFA_LABEL:
+			strlcpy(a->label, RTA_DATA(rta), IFNAMSIZ);
+			break;
+		}
+}
+
+/* ECMP routes have RTA_MULTIPATH rather than RTA_OIF and RTA_GATEWAY.
+ * Like /proc/net/route, take the first nexthop.
+ */
+static void nl_multipath(struct rtattr *rta, int *oif, struct in_addr *gw)
+{
+	struct rtnexthop *rtnh = RTA_DATA(rta);
+
+	if (RTA_PAYLOAD(rta) < sizeof(struct rtnexthop) ||
+		rtnh->rtnh_len < sizeof(struct rtnexthop) ||
+		rtnh->rtnh_len > RTA_PAYLOAD(rta))
+		return;
+
+	*oif = rtnh->rtnh_ifindex;
+	int len = rtnh->rtnh_len - sizeof(struct rtnexthop);
+	for (struct rtattr *a = RTNH_DATA(rtnh); RTA_OK(a, len); a = RTA_NEXT(a, len))
+		if (a->rta_type == RTA_GATEWAY)
+			memcpy(gw, RTA_DATA(a), sizeof(struct in_addr));
+}
+
+static void nl_route(struct nlmsghdr *nh)
+{
+	struct rtmsg *rtm = NLMSG_DATA(nh);
+	int len = RTM_PAYLOAD(nh);
+
+	if (rtm->rtm_family != AF_INET || rtm->rtm_type != RTN_UNICAST ||
+		rtm->rtm_dst_len != 0)
+		return;
+
+	unsigned table = rtm->rtm_table;
+	struct nl_gw gw = { 0 };
+	for (struct rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		switch (rta->rta_type) {
+		case RTA_TABLE:
+			table = *(unsigned *)RTA_DATA(rta);
+			break;
+		case RTA_OIF:
+			gw.oif = *(int *)RTA_DATA(rta);
+			break;
+		case RTA_GATEWAY:
+			memcpy(&gw.gw, RTA_DATA(rta), sizeof(struct in_addr));
+			break;
+		case RTA_MULTIPATH:
+			nl_multipath(rta, &gw.oif, &gw.gw);
+			break;
+		}
+
+	/* Like /proc/net/route, only the main table */
+	if (table != RT_TABLE_MAIN || gw.gw.s_addr == 0)
+		return;
+
+	nl.gws = grow(nl.gws, nl.ngws, sizeof(struct nl_gw));
+	nl.gws[nl.ngws++] = gw;
+}
+
+/* Returns 0 on success, -1 with errno set */
+static int nl_dump(int type, void (*fn)(struct nlmsghdr *nh))
+{
+	struct {
+		struct nlmsghdr nh;
+		struct rtgenmsg gen;
+	} req = {
+		.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg)),
+		.nh.nlmsg_type = type,
+		.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+		.nh.nlmsg_seq = type,
+		.gen.rtgen_family = type == RTM_GETLINK ? AF_UNSPEC : AF_INET,
+	};
+
+	if (send(nl.sock, &req, req.nh.nlmsg_len, 0) < 0)
+		return -1;
+
+	/* Big reads, a dump fills as much of the buffer as it can */
+	static long buf[0x10000 / sizeof(long)];
+	while (1) {
+		int n = recv(nl.sock, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+			if (nh->nlmsg_seq != type)
+				continue;
+			if (nh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(nh);
+				errno = -e->error;
+				return -1;
+			}
+			fn(nh);
+		}
+	}
+}
+
+/* -r looks up routes the way the default rules do: the local table,
+ * then main, then default. Main can be a full table of a million
+ * prefixes. Each table is loaded once into a path compressed binary
+ * trie: a node only exists where a prefix ends or two prefixes branch,
+ * so a lookup is a few node visits rather than a scan of the table.
+ */
+struct fib_route {
+	struct in_addr gw; /* 0 if directly connected */
+	int oif;
+	unsigned metric;
+	unsigned char type; /* RTN_* */
+};
+
+struct fib_node {
+	uint32_t key; /* host order, masked to bits */
+	int bits;
+	int route; /* index in routes, -1 if only a branch */
+	unsigned child[2]; /* 0 is none, the root is never a child */
+};
+
+struct fib {
+	unsigned table;
+	struct fib_node *nodes;
+	int nnodes;
+	struct fib_route *routes;
+	int nroutes;
+};
+
+#define NFIBS 3
+
+static struct fib fibs[NFIBS] = {
+	{ .table = RT_TABLE_LOCAL },
+	{ .table = RT_TABLE_MAIN },
+	{ .table = RT_TABLE_DEFAULT },
+};
+
+/* bit 0 is the most significant */
+static inline unsigned fib_bit(uint32_t key, int bit)
+{
+	return (key >> (31 - bit)) & 1;
+}
+
+static unsigned fib_new(struct fib *f, uint32_t key, int bits, int route)
+{
+	f->nodes = grow(f->nodes, f->nnodes, sizeof(struct fib_node));
+	struct fib_node *n = &f->nodes[f->nnodes];
+	n->key = bits ? key & (~0u << (32 - bits)) : 0;
+	n->bits = bits;
+	n->route = route;
+	n->child[0] = n->child[1] = 0;
+	return f->nnodes++;
+}
+
+/* The nodes can move when the trie grows, so this works on indices */
+static void fib_insert(struct fib *f, uint32_t key, int bits, int route)
+{
+	unsigned node = 0;
+
+	key = bits ? key & (~0u << (32 - bits)) : 0;
+
+	/* node is always a prefix of key */
+	while (1) {
+		struct fib_node *n = &f->nodes[node];
+		if (n->bits == bits) {
+			/* Same prefix, different metric. The lowest wins. */
+			if (n->route < 0 || f->routes[route].metric < f->routes[n->route].metric)
+				n->route = route;
+			return;
+		}
+
+		unsigned b = fib_bit(key, n->bits);
+		unsigned c = n->child[b];
+		if (c == 0) {
+			unsigned leaf = fib_new(f, key, bits, route);
+			f->nodes[node].child[b] = leaf;
+			return;
+		}
+
+		uint32_t ckey = f->nodes[c].key;
+		int cbits = f->nodes[c].bits;
+		int m = key == ckey ? 32 : __builtin_clz(key ^ ckey);
+		if (m > cbits)
+			m = cbits;
+		if (m > bits)
+			m = bits;
+		if (m == cbits) {
+			node = c;
+			continue;
+		}
+
+		/* Split the edge at m. Either the new prefix goes there, or a
+		 * branch with the new prefix and the child under it.
+		 */
+		unsigned split;
+		if (m == bits)
+			split = fib_new(f, key, bits, route);
+		else {
+			split = fib_new(f, key, m, -1);
+			unsigned leaf = fib_new(f, key, bits, route);
+			f->nodes[split].child[fib_bit(key, m)] = leaf;
+		}
+		f->nodes[split].child[fib_bit(ckey, m)] = c;
+		f->nodes[node].child[b] = split;
+		return;
+	}
+}
+
+/* Returns the longest matching route or NULL. addr is host order. */
+static struct fib_route *fib_lookup(struct fib *f, uint32_t addr)
+{
+	int best = -1;
+	unsigned node = 0;
+
+	do {
+		struct fib_node *n = &f->nodes[node];
+		/* Path compression skipped bits, check them */
+		if (n->bits && (addr ^ n->key) >> (32 - n->bits))
+			break;
+		if (n->route >= 0)
+			best = n->route;
+		if (n->bits == 32)
+			break;
+		node = n->child[fib_bit(addr, n->bits)];
+	} while (node);
+
+	return best >= 0 ? &f->routes[best] : NULL;
+}
+
+static void nl_fib(struct nlmsghdr *nh)
+{
+	struct rtmsg *rtm = NLMSG_DATA(nh);
+	int len = RTM_PAYLOAD(nh);
+
+	if (rtm->rtm_family != AF_INET)
+		return;
+
+	/* Blackhole, unreachable, and prohibit stay in the trie so they
+	 * hide any wider route. Throw moves on to the next table.
+	 */
+	switch (rtm->rtm_type) {
+	case RTN_UNICAST:
+	case RTN_LOCAL:
+	case RTN_BROADCAST:
+	case RTN_BLACKHOLE:
+	case RTN_UNREACHABLE:
+	case RTN_PROHIBIT:
+	case RTN_THROW:
+		break;
+	default:
+		return;
+	}
+
+	unsigned table = rtm->rtm_table;
+	struct in_addr dst = { 0 };
+	struct fib_route r = { .type = rtm->rtm_type };
+	for (struct rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		switch (rta->rta_type) {
+		case RTA_TABLE:
+			table = *(unsigned *)RTA_DATA(rta);
+			break;
+		case RTA_DST:
+			memcpy(&dst, RTA_DATA(rta), sizeof(struct in_addr));
+			break;
+		case RTA_OIF:
+			r.oif = *(int *)RTA_DATA(rta);
+			break;
+		case RTA_GATEWAY:
+			memcpy(&r.gw, RTA_DATA(rta), sizeof(struct in_addr));
+			break;
+		case RTA_PRIORITY:
+			r.metric = *(unsigned *)RTA_DATA(rta);
+			break;
+		case RTA_MULTIPATH:
+			nl_multipath(rta, &r.oif, &r.gw);
+			break;
+		}
+
+	for (int i = 0; i < NFIBS; ++i)
+		if (fibs[i].table == table) {
+			struct fib *f = &fibs[i];
+			f->routes = grow(f->routes, f->nroutes, sizeof(struct fib_route));
+			f->routes[f->nroutes] = r;
+			fib_insert(f, ntohl(dst.s_addr), rtm->rtm_dst_len, f->nroutes++);
+			return;
+		}
+}
+
+static int link_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct nl_link *)a)->name, ((const struct nl_link *)b)->name);
+}
+
+/* Loads the parts in want not already loaded. Returns 0 on success, -1
+ * with errno set.
+ */
+static int nl_load(unsigned want)
+{
+	want &= ~nl.loaded;
+	if (want == 0)
+		return 0;
+
+	if (nl.sock < 0) {
+		nl.sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (nl.sock < 0)
+			return -1;
+	}
+
+	if (want & NL_LINKS) {
+		nl.nlinks = 0;
+		if (nl_dump(RTM_GETLINK, nl_link))
+			return -1;
+		qsort(nl.links, nl.nlinks, sizeof(struct nl_link), link_cmp);
+	}
+	if (want & NL_ADDRS) {
+		nl.naddrs = 0;
+		if (nl_dump(RTM_GETADDR, nl_addr))
+			return -1;
+	}
+	if (want & NL_ROUTES) {
+		nl.ngws = 0;
+		if (nl_dump(RTM_GETROUTE, nl_route))
+			return -1;
+	}
+	if (want & NL_FIB) {
+		for (int i = 0; i < NFIBS; ++i) {
+			fibs[i].nnodes = fibs[i].nroutes = 0;
+			fib_new(&fibs[i], 0, 0, -1); /* the root, 0.0.0.0/0 */
+		}
+		if (nl_dump(RTM_GETROUTE, nl_fib))
+			return -1;
+	}
+
+	nl.loaded |= want;
+	return 0;
+}
+
+/* An alias (eth0:1) finds its link (eth0) */
+static struct nl_link *nl_find(const char *ifname)
+{
+	if (nl_load(NL_LINKS))
+		return NULL;
+
+	struct nl_link key;
+	int len = strcspn(ifname, ":");
+	if (len >= IFNAMSIZ)
+		len = IFNAMSIZ - 1;
+	memcpy(key.name, ifname, len);
+	key.name[len] = 0;
+
+	struct nl_link *l = bsearch(&key, nl.links, nl.nlinks, sizeof(struct nl_link), link_cmp);
+	if (!l)
+		errno = ENODEV;
+	return l;
+}
+
 /* Returns 0 on success, < 0 for errors, and > 0 if ifname not found.
  * The gateway arg can be NULL.
  */
 static int get_gateway(const char *ifname, struct in_addr *gateway)
 {
-	FILE *fp = fopen("/proc/net/route", "r");
-	if (!fp)
+	int oif = 0;
+	if (ifname) {
+		struct nl_link *l = nl_find(ifname);
+		if (!l)
+			return -1;
+		oif = l->index;
+	}
+
+	if (nl_load(NL_ROUTES))
 		return -1;
 
-	char line[128], iface[8];
-	uint32_t dest, gw, flags;
-	while (fgets(line, sizeof(line), fp))
-		if (sscanf(line, "%s %x %x %x", iface, &dest, &gw, &flags) == 4 &&
-			dest == 0 && (flags & 2))
-			if (!ifname || strcmp(iface, ifname) == 0) {
-				fclose(fp);
-				gateway->s_addr = gw;
-				return 0;
-			}
+	for (int i = 0; i < nl.ngws; ++i)
+		if (!ifname || nl.gws[i].oif == oif) {
+			if (gateway)
+				*gateway = nl.gws[i].gw;
+			return 0;
+		}
 
-	fclose(fp);
 	return 1;
 }
 
@@ -115,16 +589,126 @@ static int set_gateway(const char *gw)
 
 static int get_hw_addr(const char *ifname, unsigned char *hwaddr)
 {
-	int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
-	if (sock == -1)
+	struct nl_link *l = nl_find(ifname);
+	if (!l)
 		return -1;
 
-	struct ifreq ifreq = { 0 };
-	strlcpy(ifreq.ifr_name, ifname, IF_NAMESIZE);
-	int rc = ioctl(sock, SIOCGIFHWADDR, &ifreq);
-	close(sock);
+	memcpy(hwaddr, l->mac, ETHER_ADDR_LEN);
+	return 0;
+}
+
+static int ip_addr(const char *ifname, struct in_addr *addr, struct in_addr *mask)
+{
+	if (nl_load(NL_LINKS | NL_ADDRS))
+		return -1;
+
+	/* The first is the primary, like SIOCGIFADDR */
+	for (int i = 0; i < nl.naddrs; ++i)
+		if (strcmp(nl.addrs[i].label, ifname) == 0) {
+			*addr = nl.addrs[i].addr;
+			*mask = nl.addrs[i].mask;
+			return 0;
+		}
+
+	if (nl_find(ifname))
+		errno = EADDRNOTAVAIL;
+	return -1;
+}
+
+/* The link status is 1 for active, 0 for no carrier, -1 if unknown */
+static int if_flags(const char *ifname, unsigned *flags, int *link)
+{
+	struct nl_link *l = nl_find(ifname);
+	if (!l)
+		return -1;
+
+	*flags = l->flags;
+	// If the interface is not up, we cannot get the link status
+	if (l->flags & IFF_UP)
+		*link = !!(l->flags & IFF_LOWER_UP);
+	else
+		*link = -1;
+	return 0;
+}
+
+/* The interface name for an index, with a table so batches of lookups
+ * do not search the links.
+ */
+static const char *nl_name(int index)
+{
+	static const char **names;
+	static int nnames;
+
+	if (!names) {
+		for (int i = 0; i < nl.nlinks; ++i)
+			if (nl.links[i].index >= nnames)
+				nnames = nl.links[i].index + 1;
+		names = calloc(nnames ? nnames : 1, sizeof(char *));
+		if (!names)
+			err(1, "calloc");
+		for (int i = 0; i < nl.nlinks; ++i)
+			names[nl.links[i].index] = nl.links[i].name;
+	}
+
+	if (index > 0 && index < nnames && names[index])
+		return names[index];
+	return "unknown";
+}
+
+static int loopback; /* its index, local addresses go out it */
+
+static int route_one(const char *dest, unsigned what)
+{
+	struct in_addr addr;
+
+	if (inet_aton(dest, &addr) == 0) {
+		if ((what & W_QUIET) == 0)
+			fprintf(stderr, "%s: Invalid address\n", dest);
+		return 1;
+	}
+
+	struct fib_route *rt = NULL;
+	for (int i = 0; i < NFIBS && !rt; ++i) {
+		rt = fib_lookup(&fibs[i], ntohl(addr.s_addr));
+		if (rt && rt->type == RTN_THROW)
+			rt = NULL;
+	}
+
+	if (!rt || (rt->type != RTN_UNICAST && rt->type != RTN_LOCAL &&
+				rt->type != RTN_BROADCAST)) {
+		if ((what & W_QUIET) == 0)
+			fprintf(stderr, "%s: No route\n", dest);
+		return 1;
+	}
+
+	if ((what & W_QUIET) == 0)
+		printf("%s %s %s\n", dest, inet_ntoa(rt->gw),
+			   nl_name(rt->type == RTN_LOCAL ? loopback : rt->oif));
+	return 0;
+}
+
+/* dest of - reads addresses from stdin, one per line */
+static int route(const char *dest, unsigned what)
+{
+	if (nl_load(NL_LINKS | NL_FIB)) {
+		perror("netlink");
+		exit(1);
+	}
+	for (int i = 0; i < nl.nlinks; ++i)
+		if (nl.links[i].flags & IFF_LOOPBACK)
+			loopback = nl.links[i].index;
+
+	if (strcmp(dest, "-"))
+		return route_one(dest, what);
+
+	char line[64];
+	int rc = 0;
+	while (fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, " \t\r\n")] = 0;
+		if (*line)
+			rc |= route_one(line, what);
+	}
 
-	memcpy(hwaddr, ifreq.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
 	return rc;
 }
 #else
@@ -350,34 +934,6 @@ static int maskcnt(unsigned mask)
 	return count;
 }
 
-static int ip_addr(const char *ifname, struct in_addr *addr, struct in_addr *mask)
-{
-	int s = socket(AF_INET, SOCK_DGRAM, 0);
-	if (s < 0)
-		return -1;
-
-	struct ifreq ifr = { 0 };
-	strlcpy(ifr.ifr_name, ifname, IFNAMSIZ);
-
-	if (ioctl(s, SIOCGIFADDR, &ifr) < 0)
-		goto failed;
-	*addr = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
-
-	// We need this zero for QNX
-	((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr = 0;
-	if (ioctl(s, SIOCGIFNETMASK, &ifr) < 0)
-		goto failed;
-	*mask = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
-
-	close(s);
-
-	return 0;
-
-failed:
-	close(s);
-	return -1;
-}
-
 static int set_ip(const char *ifname, const char *ip, unsigned mask, int down)
 {
 	int s = socket(AF_INET, SOCK_DGRAM, 0);
@@ -451,29 +1007,35 @@ failed:
 	return -1;
 }
 
-#ifdef __linux__
-static int
-link_status(int sock, const char *ifname, short flags)
+#ifndef __linux__
+static int ip_addr(const char *ifname, struct in_addr *addr, struct in_addr *mask)
 {
-	// If the interface is not up, we cannot get the link status
-	if ((flags & IFF_UP) == 0)
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0)
 		return -1;
 
-	char buf[40];
-	snprintf(buf, sizeof(buf), "/sys/class/net/%s/carrier", ifname);
-	int fd = open(buf, O_RDONLY);
-	if (fd == -1)
-		return -1;
+	struct ifreq ifr = { 0 };
+	strlcpy(ifr.ifr_name, ifname, IFNAMSIZ);
 
-	int n = read(fd, buf, sizeof(buf));
-	close(fd);
+	if (ioctl(s, SIOCGIFADDR, &ifr) < 0)
+		goto failed;
+	*addr = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
 
-	if (n < 1)
-		return -1;
+	// We need this zero for QNX
+	((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr = 0;
+	if (ioctl(s, SIOCGIFNETMASK, &ifr) < 0)
+		goto failed;
+	*mask = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+
+	close(s);
+
+	return 0;
 
-	return *buf == '1';
+failed:
+	close(s);
+	return -1;
 }
-#else
+
 // Both bits must be set
 #define ACTIVE (IFM_AVALID | IFM_ACTIVE)
 
@@ -487,38 +1049,50 @@ link_status(int sock, const char *ifname, short flags)
 
 	return (ifmr.ifm_status & ACTIVE) == ACTIVE;
 }
-#endif
 
-static char *ip_flags(const char *ifname)
+/* The link status is 1 for active, 0 for no carrier, -1 if unknown */
+static int if_flags(const char *ifname, unsigned *flags, int *link)
 {
-	static char flagstr[64];
-	struct ifreq ifreq;
-
 	int sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock < 0)
-		return "failed";
+		return -1;
 
-	memset(&ifreq, 0, sizeof(ifreq));
+	struct ifreq ifreq = { 0 };
 	strlcpy(ifreq.ifr_name, ifname, IF_NAMESIZE);
 	if (ioctl(sock, SIOCGIFFLAGS, &ifreq)) {
 		close(sock);
-		return "Failed";
+		return -1;
 	}
 
-	int link_stat = link_status(sock, ifname, ifreq.ifr_flags);
+	*flags = (unsigned short)ifreq.ifr_flags;
+	*link = link_status(sock, ifname, ifreq.ifr_flags);
 
 	close(sock);
+	return 0;
+}
+#endif
+
+static char *ip_flags(const char *ifname)
+{
+	static char flagstr[64];
+	unsigned flags;
+	int link_stat;
+
+	if (if_flags(ifname, &flags, &link_stat))
+		return "Failed";
 
-	sprintf(flagstr, "0x%04hx %s%s %s", ifreq.ifr_flags,
-			(ifreq.ifr_flags & IFF_UP) ? "UP" : "DOWN",
-			(ifreq.ifr_flags & IFF_RUNNING) ? ",RUNNING" : "",
+	sprintf(flagstr, "0x%04hx %s%s %s", (unsigned short)flags,
+			(flags & IFF_UP) ? "UP" : "DOWN",
+			(flags & IFF_RUNNING) ? ",RUNNING" : "",
 			link_stat == -1 ? "unknown" :
 			link_stat == 1 ? "active" : "no carrier");
 
 	return flagstr;
 }
 
-static int check_one(const char *ifname, struct ifaddrs *in, int state, unsigned what)
+/* If in is NULL, the address and mask are looked up */
+static int check_one(const char *ifname, const struct in_addr *in,
+					 const struct in_addr *in_mask, int state, unsigned what)
 {
 	int n = 0;
 	struct in_addr addr = { 0 }, mask = { 0 }, gw;
@@ -541,8 +1115,8 @@ static int check_one(const char *ifname, struct ifaddrs *in, int state, unsigned
 
 	int rc = 0;
 	if (in) {
-		addr = ((struct sockaddr_in *)in->ifa_addr)->sin_addr;
-		mask = ((struct sockaddr_in *)in->ifa_netmask)->sin_addr;
+		addr = *in;
+		mask = *in_mask;
 	} else
 		rc = ip_addr(ifname, &addr, &mask);
 
@@ -660,6 +1234,7 @@ static void usage(int rc)
 		  "       ipaddr -M <interface> [mac]\n"
 #ifdef __linux__
 		  "       ipaddr -T <interface>\n"
+		  "       ipaddr -r <dest>\n"
 #endif
 		  "where: -e displays everything (-ibMf)\n"
 		  "       -i displays IP address (default)\n"
@@ -675,6 +1250,8 @@ static void usage(int rc)
 		  "       -M display, or optionally set, hardware address (mac)\n"
 #ifdef __linux__
 		  "       -T create a TAP/TUN interface. Linux only.\n"
+		  "       -r display the gateway and interface for dest.\n"
+		  "          A dest of - reads addresses from stdin. Linux only.\n"
 #endif
 		  "       -V no virtual network\n"
 		  "\nInterface defaults to all interfaces.\n"
@@ -695,9 +1272,9 @@ int main(int argc, char *argv[])
 {
 	int c, rc = 0;
 	unsigned what = 0;
-	char *ifname = NULL;
+	char *ifname = NULL, *dest = NULL;
 
-	while ((c = getopt(argc, argv, "abefgmishqCDSTMV")) != EOF)
+	while ((c = getopt(argc, argv, "abefgmishqr:CDSTMV")) != EOF)
 		switch (c) {
 		case 'e':
 			what |= W_ADDRESS | W_BITS | W_FLAGS | W_MAC;
@@ -743,6 +1320,15 @@ int main(int argc, char *argv[])
 #else
 			puts("Sorry, -T is Linux only.");
 			exit(2);
+#endif
+			break;
+		case 'r':
+#ifdef __linux__
+			what |= W_ROUTE;
+			dest = optarg;
+#else
+			puts("Sorry, -r is Linux only.");
+			exit(2);
 #endif
 			break;
 		case 'M':
@@ -755,6 +1341,15 @@ int main(int argc, char *argv[])
 			exit(2);
 		}
 
+#ifdef __linux__
+	/* Before ifname, -r takes no interface */
+	if (what & W_ROUTE) {
+		if ((what & ~(W_ROUTE | W_QUIET)) || optind < argc)
+			usage(1);
+		return route(dest, what);
+	}
+#endif
+
 	if (optind < argc)
 		ifname = argv[optind++];
 
@@ -813,6 +1408,7 @@ int main(int argc, char *argv[])
 		MUST_ARGS(W_TUNTAP, 0);
 		return taptun(ifname);
 	}
+
 #else
 	if (what == W_GATEWAY) {
 		struct in_addr gw;
@@ -829,8 +1425,27 @@ int main(int argc, char *argv[])
 		what |= W_ADDRESS;
 
 	if (ifname)
-		return check_one(ifname, NULL, 0, what);
+		return check_one(ifname, NULL, NULL, 0, what);
+
+#ifdef __linux__
+	if (nl_load(NL_LINKS | NL_ADDRS)) {
+		perror("netlink");
+		exit(1);
+	}
 
+	for (int i = 0; i < nl.naddrs; ++i) {
+		struct nl_addr *a = &nl.addrs[i];
+		struct nl_link *l = nl_find(a->label);
+		if (!l || (l->flags & IFF_LOOPBACK))
+			continue;
+
+		unsigned up = l->flags & IFF_UP;
+		if ((what & W_ALL) || up) {
+			if ((what & W_NO_VIRT) == 0 || strncmp(a->label, VIRBR, sizeof(VIRBR) - 1) != 0)
+				rc |= check_one(a->label, &a->addr, &a->mask, up, what | W_GUESSED);
+		}
+	}
+#else
 	struct ifaddrs *ifa;
 	if (getifaddrs(&ifa)) {
 		perror("getifaddrs");
@@ -844,9 +1459,13 @@ int main(int argc, char *argv[])
 		unsigned up = p->ifa_flags & IFF_UP;
 		if ((what & W_ALL) || up) {
 			if ((what & W_NO_VIRT) == 0 || strncmp(p->ifa_name, VIRBR, sizeof(VIRBR) - 1) != 0)
-				rc |= check_one(p->ifa_name, p, up, what | W_GUESSED);
+				rc |= check_one(p->ifa_name,
+								&((struct sockaddr_in *)p->ifa_addr)->sin_addr,
+								&((struct sockaddr_in *)p->ifa_netmask)->sin_addr,
+								up, what | W_GUESSED);
 		}
 	}
+#endif
 
 	return rc;
 }
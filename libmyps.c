@@ -0,0 +1,580 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "myps.h"
+
+/* Group names are interned in chunks so the groups can be freed in
+ * one go.
+ */
+#define ARENA_SIZE 0x10000
+
+struct myps_arena {
+	struct myps_arena *next;
+	size_t used, size;
+	char data[];
+};
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct myps {
+	int procfd;
+	pid_t me;
+	/* Updated atomically, the reads may be threaded */
+	unsigned long syscalls;
+	unsigned long long bytes;
+
+	/* The pid listing */
+	pid_t *pids;
+	int npids, maxpids;
+
+	/* The iterator */
+	int next;
+	char cmdline[MYPS_CMDLEN];
+	char name[MYPS_CMDLEN];
+
+	/* The groups, indexed by the table */
+	struct myps_table table;
+	struct myps_group *groups;
+	int maxgroups;
+};
+
+#define COUNT(field, n) __atomic_add_fetch(&m->field, n, __ATOMIC_RELAXED)
+
+int myps_parse_stat(const char *buf, struct myps_stat *st)
+{
+	memset(st, 0, sizeof(struct myps_stat));
+
+	// Sighhh... firefox creates a (Web Content) entry
+	const char *p = strrchr(buf, ')');
+	if (!p)
+		return -1;
+
+	/* p points to the space before field 3 (state) */
+	for (int field = 3; field <= 39; ++field) {
+		p = strchr(p, ' ');
+		if (!p)
+			break;
+		++p;
+
+		switch (field) {
+		case 3:
+			st->state = *p;
+			break;
+		case 4:
+			st->ppid = strtol(p, NULL, 10);
+			break;
+		case 9:
+			st->flags = strtoul(p, NULL, 10);
+			break;
+		case 14:
+			st->utime = strtoull(p, NULL, 10);
+			break;
+		case 15:
+			st->stime = strtoull(p, NULL, 10);
+			break;
+		case 20:
+			st->num_threads = strtol(p, NULL, 10);
+			break;
+		case 22:
+			st->starttime = strtoull(p, NULL, 10);
+			break;
+		case 23:
+			st->vsize = strtoul(p, NULL, 10);
+			break;
+		case 24:
+			st->rss = strtoul(p, NULL, 10);
+			break;
+		case 39:
+			st->processor = strtol(p, NULL, 10);
+			break;
+		}
+	}
+
+	return st->starttime ? 0 : -1;
+}
+
+void myps_cmdline_spaces(char *buf, int n)
+{
+	for (int i = 0; i < n - 1; ++i)
+		if (buf[i] == 0)
+			buf[i] = ' ';
+}
+
+char *myps_cmd_name(char *cmd)
+{
+	/* /bin/sh is a special case */
+	if (strncmp(cmd, "/bin/sh", 7) == 0) {
+		if (*(cmd + 7)) {
+#if 1
+			// This drops the /bin/sh
+			cmd += 8;
+#else
+			// This keeps the /bin/sh
+			char *ptr = strchr(cmd + 8, ' ');
+			if (ptr) *ptr = 0;
+#endif
+		}
+	} else {
+		char *ptr = strchr(cmd, ' ');
+		if (ptr) *ptr = 0;
+	}
+
+	return cmd;
+}
+
+unsigned myps_hash(const char *str, size_t *len)
+{
+	unsigned hash = 2166136261u;
+	const char *p;
+
+	for (p = str; *p; ++p)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+	*len = p - str;
+	return hash;
+}
+
+struct myps *myps_open(const char *proc_root)
+{
+	struct myps *m = calloc(1, sizeof(struct myps));
+	if (!m)
+		return NULL;
+
+	m->procfd = open(proc_root, O_RDONLY | O_DIRECTORY);
+	if (m->procfd < 0) {
+		free(m);
+		return NULL;
+	}
+	m->me = getpid();
+
+	return m;
+}
+
+void myps_close(struct myps *m)
+{
+	if (!m)
+		return;
+	myps_table_free(&m->table);
+	free(m->groups);
+	free(m->pids);
+	close(m->procfd);
+	free(m);
+}
+
+int myps_procfd(struct myps *m)
+{
+	return m->procfd;
+}
+
+void myps_counts(struct myps *m, unsigned long *syscalls,
+				 unsigned long long *bytes)
+{
+	*syscalls = __atomic_load_n(&m->syscalls, __ATOMIC_RELAXED);
+	*bytes = __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+}
+
+int myps_readproc(struct myps *m, pid_t pid, const char *file, char *buf, int len)
+{
+	char fname[32];
+	int fd, n;
+
+	*buf = 0;
+
+	snprintf(fname, sizeof(fname), "%u/%s", pid, file);
+	fd = openat(m->procfd, fname, O_RDONLY);
+	if (fd < 0) {
+		COUNT(syscalls, 1);
+		return -1;
+	}
+	n = read(fd, buf, len - 1);
+	close(fd);
+	COUNT(syscalls, 3);
+	if (n > 0)
+		COUNT(bytes, n);
+
+	/* Zero length is not an error. Some files, like a kernel thread
+	 * cmdline, are zero length.
+	 */
+	if (n < 0)
+		return -1;
+
+	buf[n] = 0;
+	return n;
+}
+
+int myps_readcmdline(struct myps *m, pid_t pid, char *buf, int len)
+{
+	int n = myps_readproc(m, pid, "cmdline", buf, len);
+
+	if (n > 0)
+		myps_cmdline_spaces(buf, n);
+
+	return n;
+}
+
+int myps_readdir(struct myps *m, int fd, char *buf, int len,
+				 int (*fn)(const char *name, void *arg), void *arg)
+{
+	int n;
+
+	while ((n = syscall(SYS_getdents64, fd, buf, len)) > 0) {
+		COUNT(syscalls, 1);
+		for (int off = 0; off < n; ) {
+			struct linux_dirent64 *ent = (struct linux_dirent64 *)(buf + off);
+			off += ent->d_reclen;
+
+			if (!isdigit(*ent->d_name))
+				continue;
+			int rc = fn(ent->d_name, arg);
+			if (rc)
+				return rc;
+		}
+	}
+	COUNT(syscalls, 1); /* the final getdents64 */
+
+	return n < 0 ? -1 : 0;
+}
+
+static int add_pid(const char *name, void *arg)
+{
+	struct myps *m = arg;
+
+	if (m->npids >= m->maxpids) {
+		int max = m->maxpids ? m->maxpids * 2 : 1024;
+		pid_t *pids = realloc(m->pids, max * sizeof(pid_t));
+		if (!pids)
+			return -1;
+		m->pids = pids;
+		m->maxpids = max;
+	}
+	m->pids[m->npids++] = strtol(name, NULL, 10);
+	return 0;
+}
+
+int myps_pids(struct myps *m, const pid_t **pids)
+{
+	char *buf = malloc(MYPS_DENTSLEN);
+	if (!buf)
+		return -1;
+
+	m->npids = 0;
+	lseek(m->procfd, 0, SEEK_SET);
+	COUNT(syscalls, 1);
+	int rc = myps_readdir(m, m->procfd, buf, MYPS_DENTSLEN, add_pid, m);
+	free(buf);
+	if (rc)
+		return -1;
+
+	*pids = m->pids;
+	return m->npids;
+}
+
+int myps_rewind(struct myps *m)
+{
+	const pid_t *pids;
+
+	m->next = 0;
+	if (myps_pids(m, &pids) < 0) {
+		m->npids = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int myps_read(struct myps *m, pid_t pid, struct myps_proc *p, char *buf, int len)
+{
+	char stat[MYPS_STATLEN];
+
+	if (pid == m->me)
+		return 0;
+	if (myps_readproc(m, pid, "stat", stat, sizeof(stat)) <= 0 ||
+		myps_parse_stat(stat, &p->stat))
+		return -1;
+
+	p->pid = pid;
+	p->cmdline = buf;
+	p->name = NULL;
+	*buf = 0;
+
+	/* Don't bother reading the (empty) cmdline of kernel threads */
+	if (p->stat.flags & MYPS_PF_KTHREAD)
+		return 0;
+
+	int n = myps_readcmdline(m, pid, buf, len);
+	return n < 0 ? -1 : n > 0;
+}
+
+int myps_next(struct myps *m, struct myps_proc *p)
+{
+	while (m->next < m->npids) {
+		/* Pids that exit while we read them are skipped */
+		pid_t pid = m->pids[m->next++];
+		if (myps_read(m, pid, p, m->cmdline, sizeof(m->cmdline)) <= 0)
+			continue;
+
+		/* The name is cut out of a copy */
+		strcpy(m->name, m->cmdline);
+		p->name = myps_cmd_name(m->name);
+		return 1;
+	}
+
+	return 0;
+}
+
+int myps_foreach(struct myps *m,
+				 int (*fn)(const struct myps_proc *p, void *arg), void *arg)
+{
+	struct myps_proc p;
+	int rc;
+
+	if (myps_rewind(m))
+		return -1;
+	while ((rc = myps_next(m, &p)) > 0) {
+		rc = fn(&p, arg);
+		if (rc)
+			return rc;
+	}
+
+	return rc;
+}
+
+static const char *intern(struct myps_table *t, const char *str, size_t len)
+{
+	struct myps_arena *arena = t->arena;
+
+	if (!arena || arena->used + len + 1 > arena->size) {
+		size_t size = len + 1 > ARENA_SIZE ? len + 1 : ARENA_SIZE;
+		arena = malloc(sizeof(struct myps_arena) + size);
+		if (!arena)
+			return NULL;
+		arena->next = t->arena;
+		arena->used = 0;
+		arena->size = size;
+		t->arena = arena;
+	}
+
+	char *p = arena->data + arena->used;
+	memcpy(p, str, len + 1);
+	arena->used += len + 1;
+	return p;
+}
+
+static int rehash(struct myps_table *t, unsigned size)
+{
+	unsigned *tab = calloc(size, sizeof(unsigned));
+	if (!tab)
+		return -1;
+
+	for (int i = 0; i < t->n; ++i) {
+		unsigned h = t->keys[i].hash & (size - 1);
+		while (tab[h])
+			h = (h + 1) & (size - 1);
+		tab[h] = i + 1;
+	}
+
+	free(t->hashtab);
+	t->hashtab = tab;
+	t->hashsize = size;
+	return 0;
+}
+
+int myps_lookup(struct myps_table *t, const char *name, const char *interned)
+{
+	size_t len;
+	unsigned hash = myps_hash(name, &len);
+
+	/* Keep the load factor under 50% */
+	if ((unsigned)t->n * 2 >= t->hashsize &&
+		rehash(t, t->hashsize ? t->hashsize * 2 : 1024))
+		return -1;
+
+	unsigned h = hash & (t->hashsize - 1);
+	for (; t->hashtab[h]; h = (h + 1) & (t->hashsize - 1)) {
+		int i = t->hashtab[h] - 1;
+		if (t->keys[i].hash == hash && strcmp(name, t->keys[i].name) == 0)
+			return i;
+	}
+
+	if (t->n >= t->max) {
+		int max = t->max ? t->max * 2 : 64;
+		struct myps_key *keys = realloc(t->keys, max * sizeof(struct myps_key));
+		if (!keys)
+			return -1;
+		t->keys = keys;
+		t->max = max;
+	}
+
+	struct myps_key *k = &t->keys[t->n];
+	if (!(k->name = interned ? interned : intern(t, name, len)))
+		return -1;
+	k->hash = hash;
+	t->hashtab[h] = t->n + 1;
+	return t->n++;
+}
+
+void myps_table_move(struct myps_table *dst, struct myps_table *src)
+{
+	struct myps_arena *arena = src->arena;
+
+	if (arena) {
+		while (arena->next)
+			arena = arena->next;
+		arena->next = dst->arena;
+		dst->arena = src->arena;
+		src->arena = NULL;
+	}
+}
+
+void myps_table_clear(struct myps_table *t)
+{
+	while (t->arena) {
+		struct myps_arena *next = t->arena->next;
+		free(t->arena);
+		t->arena = next;
+	}
+	t->n = 0;
+	if (t->hashtab)
+		memset(t->hashtab, 0, t->hashsize * sizeof(unsigned));
+}
+
+void myps_table_free(struct myps_table *t)
+{
+	myps_table_clear(t);
+	free(t->keys);
+	free(t->hashtab);
+	memset(t, 0, sizeof(struct myps_table));
+}
+
+void myps_group_add(struct myps_group *g, const struct myps_group *src)
+{
+	if (g->count == 0 || src->pid < g->pid)
+		g->pid = src->pid;
+	if (g->count == 0 || src->starttime < g->starttime)
+		g->starttime = src->starttime;
+	g->count += src->count;
+	g->cpu += src->cpu;
+	g->rss += src->rss;
+	g->threads += src->threads;
+}
+
+void myps_group_proc(struct myps_group *g, const struct myps_proc *p)
+{
+	struct myps_group one = {
+		.count = 1,
+		.pid = p->pid,
+		.starttime = p->stat.starttime,
+		.cpu = p->stat.utime + p->stat.stime,
+		.rss = p->stat.rss,
+		.threads = p->stat.num_threads,
+	};
+
+	myps_group_add(g, &one);
+}
+
+static int add_proc(const struct myps_proc *p, void *arg)
+{
+	struct myps *m = arg;
+	int n = m->table.n;
+	int i = myps_lookup(&m->table, p->name, NULL);
+	if (i < 0)
+		return -1;
+
+	if (i >= m->maxgroups) {
+		int max = m->table.max;
+		struct myps_group *groups = realloc(m->groups, max * sizeof(struct myps_group));
+		if (!groups)
+			return -1;
+		m->groups = groups;
+		m->maxgroups = max;
+	}
+
+	struct myps_group *g = &m->groups[i];
+	if (i == n) {
+		memset(g, 0, sizeof(struct myps_group));
+		g->name = m->table.keys[i].name;
+	}
+	myps_group_proc(g, p);
+	return 0;
+}
+
+int myps_scan(struct myps *m)
+{
+	myps_table_clear(&m->table);
+	if (myps_foreach(m, add_proc, m)) {
+		myps_table_clear(&m->table);
+		return -1;
+	}
+
+	return m->table.n;
+}
+int myps_group_cmp(const struct myps_group *a, const struct myps_group *b, int sort)
+{
+#define BIGGEST(f) if (a->f != b->f) return a->f > b->f ? -1 : 1
+	switch (sort) {
+	case MYPS_SORT_CPU:
+		BIGGEST(cpu);
+		break;
+	case MYPS_SORT_RSS:
+		BIGGEST(rss);
+		break;
+	case MYPS_SORT_THREADS:
+		BIGGEST(threads);
+		break;
+	case MYPS_SORT_COUNT:
+		BIGGEST(count);
+		break;
+	}
+#undef BIGGEST
+
+	if (a->starttime == b->starttime)
+		return a->pid < b->pid ? -1 : 1;
+	return a->starttime < b->starttime ? -1 : 1;
+}
+
+/* qsort has no argument, so the key is in the comparison */
+#define GROUP_CMP(fn, sort)										\
+	static int fn(const void *a, const void *b)					\
+	{															\
+		return myps_group_cmp(a, b, sort);						\
+	}
+
+GROUP_CMP(start_cmp, MYPS_SORT_START)
+GROUP_CMP(cpu_cmp, MYPS_SORT_CPU)
+GROUP_CMP(rss_cmp, MYPS_SORT_RSS)
+GROUP_CMP(threads_cmp, MYPS_SORT_THREADS)
+GROUP_CMP(count_cmp, MYPS_SORT_COUNT)
+
+const struct myps_group *myps_groups(struct myps *m, int sort, int *ngroups)
+{
+	static int (*const cmps[])(const void *, const void *) = {
+		[MYPS_SORT_START] = start_cmp,
+		[MYPS_SORT_CPU] = cpu_cmp,
+		[MYPS_SORT_RSS] = rss_cmp,
+		[MYPS_SORT_THREADS] = threads_cmp,
+		[MYPS_SORT_COUNT] = count_cmp,
+	};
+
+	if (sort < 0 || sort > MYPS_SORT_COUNT)
+		sort = MYPS_SORT_START;
+
+	/* Sorting moves the groups, so the table is rebuilt by the next
+	 * scan.
+	 */
+	qsort(m->groups, m->table.n, sizeof(struct myps_group), cmps[sort]);
+
+	*ngroups = m->table.n;
+	return m->groups;
+}
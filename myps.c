@@ -1,228 +1,4141 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <errno.h>
-#include <dirent.h>
+#include <regex.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
 
-static struct aproc {
-	const char *cmd;
-	int count;
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "myps.h"
+
+/* /proc/<pid>/io, for --io */
+struct ioacct {
+	unsigned long long rbytes, wbytes; /* hit the block layer */
+	unsigned long long syscr, syscw;
+};
+
+/* /proc/<pid>/fd by type, for --fds */
+struct fdcount {
+	unsigned files, sockets, pipes, other;
+};
+
+/* smaps_rollup in KB, for --pss */
+struct memacct {
+	unsigned long long pss, uss, swap;
+};
+
+/* Placement, for --numa. Only allocated in that mode. */
+#define NUMA_CPUS 1024
+#define NUMA_NODES 64
+#define NUMA_WORDS (NUMA_CPUS / 64)
+
+struct numa {
+	uint64_t ran[NUMA_WORDS]; /* the CPUs they last ran on */
+	uint64_t allowed[NUMA_WORDS]; /* Cpus_allowed_list */
+	uint64_t mems; /* Mems_allowed_list */
+	unsigned nodes[NUMA_NODES]; /* processes by the node they last ran on */
+};
+
+struct aproc {
+	struct myps_group g; /* the name is the group key */
+	/* --sched, from schedstat */
+	unsigned long long run_ns; /* on the CPU */
+	unsigned long long wait_ns; /* on a run queue */
+	unsigned long long slices;
+	struct ioacct io; /* --io */
+	struct fdcount fds; /* --fds */
+	struct numa *numa; /* --numa */
+	struct memacct mem; /* --pss */
+	/* -t only */
+	unsigned long long dcpu; /* ticks since the last refresh */
+	unsigned long prev_rss;
+	unsigned long long dwait; /* wait_ns since the last refresh */
+	struct ioacct dio;
+};
+
+/* A grouping table. names indexes procs and holds the cmd
+ * strings, so procs must not be reordered.
+ */
+struct ptable {
+	struct aproc *procs;
+	int curproc, maxproc;
+	struct myps_table names;
+	/* Every pid and its group, only kept if want_members is set */
+	struct member {
+		pid_t pid, ppid;
+		int group; /* index into procs */
+		unsigned long long starttime; /* to catch pid reuse */
+		unsigned long long cpu;
+		unsigned long rss;
+	} *members;
+	int nmembers, maxmembers;
+};
+
+static int want_members;
+
+static struct ptable table;
+
+static pid_t me;
+static struct myps *ctx;
+static int procfd = -1;
+
+/* Per scan statistics. Updated atomically since the scan may be
+ * threaded.
+ */
+static struct {
+	unsigned long syscalls;
+	unsigned long long bytes; /* read from /proc */
+	int pids;
+	int kthreads;
+	int races; /* pids that exited while we were reading them */
+	pid_t daemon; /* if the table came from a -d daemon */
+	int timing; /* only read the clock if someone wants the times */
+	uint64_t ns[11]; /* phase times */
+} stats;
+
+/* read, the stat and cmdline of each pid, and group are summed over
+ * the scan threads, so they can add up to more than scan. The io_uring
+ * engine only reports scan.
+ */
+enum {
+	T_LIST, T_SCAN, T_READ, T_GROUP, T_MATCH, T_TASKS, T_FDS, T_PSS,
+	T_SORT, T_PRINT, T_WAIT
+};
+static const char *phases[] = {
+	"list", "scan", "read", "group", "match", "threads", "fds", "pss",
+	"sort", "print", "wait"
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#define COUNT(field, n) __atomic_add_fetch(&stats.field, n, __ATOMIC_RELAXED)
+
+/* The reads through ctx are counted by libmyps, add them in */
+static unsigned long total_syscalls(unsigned long long *bytes)
+{
+	unsigned long syscalls;
+	unsigned long long n;
+
+	myps_counts(ctx, &syscalls, &n);
+	if (bytes)
+		*bytes = stats.bytes + n;
+	return stats.syscalls + syscalls;
+}
+
+/* --sched: schedstat is per thread, /proc/<pid>/schedstat is only the
+ * main thread, so sum task/<tid>/schedstat when there is more than
+ * one thread.
+ */
+static int show_sched;
+
+static void sched_add(pid_t pid, const char *file, struct aproc *p)
+{
+	char buf[128];
+	unsigned long long run, wait, slices;
+
+	if (myps_readproc(ctx, pid, file, buf, sizeof(buf)) > 0 &&
+		sscanf(buf, "%llu %llu %llu", &run, &wait, &slices) == 3) {
+		p->run_ns += run;
+		p->wait_ns += wait;
+		p->slices += slices;
+	}
+}
+
+/* --io. Unlike schedstat, io covers all the threads, even the dead
+ * ones. Other users' processes need root.
+ */
+static int show_io;
+
+static void read_io(pid_t pid, struct ioacct *io)
+{
+	char buf[512];
+
+	if (myps_readproc(ctx, pid, "io", buf, sizeof(buf)) <= 0)
+		return;
+
+	for (char *line = buf; line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			++line;
+		char *val = strchr(line, ':');
+		if (!val)
+			break;
+		unsigned long long n = strtoull(val + 1, NULL, 10);
+		if (strncmp(line, "read_bytes:", 11) == 0)
+			io->rbytes = n;
+		else if (strncmp(line, "write_bytes:", 12) == 0)
+			io->wbytes = n;
+		else if (strncmp(line, "syscr:", 6) == 0)
+			io->syscr = n;
+		else if (strncmp(line, "syscw:", 6) == 0)
+			io->syscw = n;
+	}
+}
+
+/* --numa. The CPU to node map is read from sysfs once, without it
+ * everything is node 0.
+ */
+static int show_numa;
+static signed char cpu_node[NUMA_CPUS];
+
+/* A cpu list like 0-3,8,10-11 into a bitmap */
+static void parse_list(const char *str, uint64_t *bits, int nbits)
+{
+	while (isdigit(*str)) {
+		char *end;
+		int lo = strtol(str, &end, 10), hi = lo;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for (int i = lo; i <= hi && i < nbits; ++i)
+			bits[i / 64] |= 1ull << (i % 64);
+		if (*end != ',')
+			break;
+		str = end + 1;
+	}
+}
+
+/* And back again */
+static char *format_list(const uint64_t *bits, int nbits, char *buf, int len)
+{
+	int n = 0;
+
+	*buf = 0;
+	for (int i = 0; i < nbits && n < len; ++i) {
+		if (!(bits[i / 64] & (1ull << (i % 64))))
+			continue;
+		int j = i;
+		while (j + 1 < nbits && (bits[(j + 1) / 64] & (1ull << ((j + 1) % 64))))
+			++j;
+		if (j > i)
+			n += snprintf(buf + n, len - n, "%s%d-%d", n ? "," : "", i, j);
+		else
+			n += snprintf(buf + n, len - n, "%s%d", n ? "," : "", i);
+		i = j;
+	}
+	if (!*buf)
+		snprintf(buf, len, "-");
+	return buf;
+}
+
+static void numa_init(void)
+{
+	char fname[64], buf[0x1000];
+
+	for (int node = 0; node < NUMA_NODES; ++node) {
+		snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%d/cpulist", node);
+		int fd = open(fname, O_RDONLY);
+		if (fd < 0)
+			continue; /* nodes can have holes */
+		int n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n <= 0)
+			continue;
+		buf[n] = 0;
+
+		uint64_t cpus[NUMA_WORDS] = { 0 };
+		parse_list(buf, cpus, NUMA_CPUS);
+		for (int i = 0; i < NUMA_CPUS; ++i)
+			if (cpus[i / 64] & (1ull << (i % 64)))
+				cpu_node[i] = node;
+	}
+}
+
+/* A "Name:\t0-3" line of status */
+static void status_list(const char *buf, const char *name, uint64_t *bits, int nbits)
+{
+	const char *line = strstr(buf, name);
+
+	if (line) {
+		line += strlen(name);
+		parse_list(line + strspn(line, " \t"), bits, nbits);
+	}
+}
+
+static void read_numa(pid_t pid, int processor, struct numa *numa)
+{
+	char buf[0x1000];
+
+	if (processor >= 0 && processor < NUMA_CPUS) {
+		numa->ran[processor / 64] |= 1ull << (processor % 64);
+		++numa->nodes[cpu_node[processor]];
+	}
+
+	if (myps_readproc(ctx, pid, "status", buf, sizeof(buf)) <= 0)
+		return;
+
+	status_list(buf, "\nCpus_allowed_list:", numa->allowed, NUMA_CPUS);
+	status_list(buf, "\nMems_allowed_list:", &numa->mems, NUMA_NODES);
+}
+
+struct schedtasks {
 	pid_t pid;
-	unsigned long long time;
-} *procs;
-static int curproc;
+	struct aproc *p;
+};
+
+static int sched_task(const char *name, void *arg)
+{
+	struct schedtasks *t = arg;
+	char file[32];
+
+	snprintf(file, sizeof(file), "task/%s/schedstat", name);
+	sched_add(t->pid, file, t->p);
+	return 0;
+}
+
+static void read_sched(pid_t pid, int nthreads, struct aproc *p)
+{
+	if (nthreads <= 1) {
+		sched_add(pid, "schedstat", p);
+		return;
+	}
+
+	/* Called from the scan threads, so the buffer is on the stack.
+	 * Most processes have few enough threads for one getdents64.
+	 */
+	char dir[32], buf[0x2000];
+	snprintf(dir, sizeof(dir), "%u/task", pid);
+	int fd = openat(procfd, dir, O_RDONLY | O_DIRECTORY);
+	COUNT(syscalls, 1);
+	if (fd < 0)
+		return;
+
+	struct schedtasks t = { pid, p };
+	myps_readdir(ctx, fd, buf, sizeof(buf), sched_task, &t);
+	close(fd);
+	COUNT(syscalls, 1);
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		fputs("Out of memory!\n", stderr);
+		exit(1);
+	}
+	return ptr;
+}
+
+static void *xcalloc(size_t n, size_t size)
+{
+	void *ptr = calloc(n, size);
+	if (!ptr) {
+		fputs("Out of memory!\n", stderr);
+		exit(1);
+	}
+	return ptr;
+}
+
+static void free_procs(struct ptable *t)
+{
+	myps_table_free(&t->names);
+	for (int i = 0; i < t->curproc; ++i)
+		free(t->procs[i].numa);
+	free(t->procs);
+	free(t->members);
+	memset(t, 0, sizeof(struct ptable));
+}
+
+/* Returns the group for cmd, creating an empty one if needed. If the
+ * cmd is already interned (merging), pass it as interned and the
+ * string will not be copied.
+ */
+static struct aproc *lookup(struct ptable *t, const char *cmd,
+							const char *interned)
+{
+	int i = myps_lookup(&t->names, cmd, interned);
+	if (i < 0) {
+		fputs("Out of memory!\n", stderr);
+		exit(1);
+	}
+	if (i < t->curproc)
+		return &t->procs[i];
+
+	if (t->curproc >= t->maxproc) {
+		t->maxproc = t->maxproc ? t->maxproc * 2 : 64;
+		t->procs = xrealloc(t->procs, t->maxproc * sizeof(struct aproc));
+	}
+	struct aproc *p = &t->procs[t->curproc++];
+	memset(p, 0, sizeof(struct aproc));
+	p->g.name = t->names.keys[i].name;
+	return p;
+}
+
+static void add_member(struct ptable *t, const struct member *m)
+{
+	if (t->nmembers >= t->maxmembers) {
+		t->maxmembers = t->maxmembers ? t->maxmembers * 2 : 1024;
+		t->members = xrealloc(t->members, t->maxmembers * sizeof(struct member));
+	}
+	t->members[t->nmembers++] = *m;
+}
+
+/* Add src, a single process or another group, to the group p */
+static void group(struct aproc *p, const struct aproc *src)
+{
+	myps_group_add(&p->g, &src->g);
+	p->run_ns += src->run_ns;
+	p->wait_ns += src->wait_ns;
+	p->slices += src->slices;
+	p->io.rbytes += src->io.rbytes;
+	p->io.wbytes += src->io.wbytes;
+	p->io.syscr += src->io.syscr;
+	p->io.syscw += src->io.syscw;
+	p->fds.files += src->fds.files;
+	p->fds.sockets += src->fds.sockets;
+	p->fds.pipes += src->fds.pipes;
+	p->fds.other += src->fds.other;
+	p->mem.pss += src->mem.pss;
+	p->mem.uss += src->mem.uss;
+	p->mem.swap += src->mem.swap;
+
+	if (src->numa) {
+		if (!p->numa)
+			p->numa = xcalloc(1, sizeof(struct numa));
+		for (int i = 0; i < NUMA_WORDS; ++i) {
+			p->numa->ran[i] |= src->numa->ran[i];
+			p->numa->allowed[i] |= src->numa->allowed[i];
+		}
+		p->numa->mems |= src->numa->mems;
+		for (int i = 0; i < NUMA_NODES; ++i)
+			p->numa->nodes[i] += src->numa->nodes[i];
+	}
+}
+
+/* -c groups by cgroup and then command. The group key is the cgroup
+ * path, a tab, and the command.
+ */
+static int by_cgroup; /* 2 to list the commands too */
+
+static char *cgroup_key(pid_t pid, const char *cmd, char *key, int len)
+{
+	char buf[0x1001], *path = NULL;
+
+	/* Prefer the v2 (0::) hierarchy, else whatever is first */
+	if (myps_readproc(ctx, pid, "cgroup", buf, sizeof(buf)) > 0) {
+		for (char *line = buf; line && *line; ) {
+			char *next = strchr(line, '\n');
+			if (next)
+				*next++ = 0;
+			char *p = strchr(line, ':');
+			if (p && (p = strchr(p + 1, ':'))) {
+				if (strncmp(line, "0::", 3) == 0) {
+					path = p + 1;
+					break;
+				}
+				if (!path)
+					path = p + 1;
+			}
+			line = next;
+		}
+	}
+
+	snprintf(key, len, "%s\t%s", path ? path : "?", cmd);
+	return key;
+}
+
+/* Group proc under cmd, its cmdline */
+static struct aproc *add_cmdline(struct ptable *t, char *cmd,
+								 const struct myps_proc *proc)
+{
+	const struct myps_stat *st = &proc->stat;
+	pid_t pid = proc->pid;
+	struct aproc one = { 0 };
+
+	myps_group_proc(&one.g, proc);
+	if (show_sched)
+		read_sched(pid, st->num_threads, &one);
+	if (show_io)
+		read_io(pid, &one.io);
+	struct numa numa = { 0 };
+	if (show_numa) {
+		read_numa(pid, st->processor, &numa);
+		one.numa = &numa;
+	}
+	uint64_t start = stats.timing ? now_ns() : 0;
+	char key[0x2000];
+	cmd = myps_cmd_name(cmd);
+	if (by_cgroup)
+		cmd = cgroup_key(pid, cmd, key, sizeof(key));
+	struct aproc *p = lookup(t, cmd, NULL);
+	group(p, &one);
+	if (want_members) {
+		struct member m = {
+			.pid = pid,
+			.ppid = st->ppid,
+			.group = p - t->procs,
+			.starttime = st->starttime,
+			.cpu = one.g.cpu,
+			.rss = one.g.rss,
+		};
+		add_member(t, &m);
+	}
+	if (stats.timing)
+		COUNT(ns[T_GROUP], now_ns() - start);
+	return p;
+}
+
+/* Returns the pid's group, or NULL if it was skipped. The stat is
+ * returned in st.
+ */
+static struct aproc *add_proc(struct ptable *t, pid_t pid, struct myps_stat *st)
+{
+	if (pid == me) return NULL;
+
+	struct myps_proc proc;
+	char buf[MYPS_CMDLEN];
+	uint64_t start = stats.timing ? now_ns() : 0;
+	int rc = myps_read(ctx, pid, &proc, buf, sizeof(buf));
+	if (stats.timing)
+		COUNT(ns[T_READ], now_ns() - start);
+	if (rc < 0) {
+		fprintf(stderr, "%d: readproc failed\n", pid);
+		COUNT(races, 1);
+		return NULL;
+	}
+
+	*st = proc.stat;
+	if (rc == 0) {
+		if (st->flags & MYPS_PF_KTHREAD)
+			COUNT(kthreads, 1);
+		return NULL;
+	}
+
+	return add_cmdline(t, buf, &proc);
+}
+
+/* Merge the shard src into dst. The src arenas are handed over to dst
+ * rather than copying the strings.
+ */
+static void merge(struct ptable *dst, struct ptable *src)
+{
+	int *remap = xrealloc(NULL, (src->curproc + 1) * sizeof(int));
+
+	for (int i = 0; i < src->curproc; ++i) {
+		struct aproc *s = &src->procs[i];
+		struct aproc *p = lookup(dst, s->g.name, s->g.name);
+		group(p, s);
+		remap[i] = p - dst->procs;
+	}
+
+	for (int i = 0; i < src->nmembers; ++i) {
+		struct member m = src->members[i];
+		m.group = remap[m.group];
+		add_member(dst, &m);
+	}
+	free(remap);
+
+	myps_table_move(&dst->names, &src->names);
+	free_procs(src);
+}
+
+static int read_pids(const pid_t **pids)
+{
+	int npids = myps_pids(ctx, pids);
+
+	if (npids < 0) {
+		perror("/proc");
+		exit(1);
+	}
+
+	stats.pids = npids;
+	return npids;
+}
+
+#ifdef HAVE_URING
+/* The io_uring engine. Each batch of pids costs two io_uring_enter
+ * calls: one for all the opens and one for all the reads, each read
+ * hardlinked to the close of its fd.
+ */
+#define BATCH 512
+
+struct uring {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len, sqes_len;
+
+	/* Per pid state for one batch. Index 0 is cmdline, 1 is stat. */
+	struct uslot {
+		pid_t pid;
+		char path[2][32];
+		int fd[2];
+		int n[2];
+		int closed[2]; /* 1 until the CLOSE completes */
+		char cmdline[MYPS_CMDLEN];
+		char stat[MYPS_STATLEN];
+	} *slots;
+};
+
+static void uring_free(struct uring *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_len);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_len);
+	if (u->fd >= 0)
+		close(u->fd);
+	free(u->slots);
+	memset(u, 0, sizeof(struct uring));
+	u->fd = -1;
+}
+
+static void *uring_mmap(int fd, size_t len, off_t off)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, fd, off);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* Returns 0 on success. On failure, the caller should fall back to
+ * add_proc().
+ */
+static int uring_init(struct uring *u)
+{
+	struct io_uring_params p = { 0 };
+
+	memset(u, 0, sizeof(struct uring));
+	u->fd = syscall(__NR_io_uring_setup, BATCH * 4, &p);
+	if (u->fd < 0)
+		return -1;
+
+	/* OPENAT, READ, and CLOSE all predate FAST_POLL */
+	if (!(p.features & IORING_FEAT_FAST_POLL))
+		goto failed;
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ring = uring_mmap(u->fd, u->sq_len, IORING_OFF_SQ_RING);
+	if (!u->sq_ring)
+		goto failed;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else if (!(u->cq_ring = uring_mmap(u->fd, u->cq_len, IORING_OFF_CQ_RING)))
+		goto failed;
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = uring_mmap(u->fd, u->sqes_len, IORING_OFF_SQES);
+	if (!u->sqes)
+		goto failed;
+
+	u->sq_tail = u->sq_ring + p.sq_off.tail;
+	u->sq_mask = u->sq_ring + p.sq_off.ring_mask;
+	u->sq_array = u->sq_ring + p.sq_off.array;
+	u->cq_head = u->cq_ring + p.cq_off.head;
+	u->cq_tail = u->cq_ring + p.cq_off.tail;
+	u->cq_mask = u->cq_ring + p.cq_off.ring_mask;
+	u->cqes = u->cq_ring + p.cq_off.cqes;
+
+	u->slots = malloc(BATCH * sizeof(struct uslot));
+	if (!u->slots)
+		goto failed;
+
+	return 0;
+
+failed:
+	uring_free(u);
+	return -1;
+}
+
+/* The result of each sqe is written to the int user_data points to.
+ * A zero user_data means we don't care about the result.
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *u, int opcode, int fd,
+									  void *addr, int *res)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->user_data = (uintptr_t)res;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/* Submit n sqes and wait for all n completions */
+static int uring_run(struct uring *u, unsigned n)
+{
+	unsigned submit = n;
+
+	while (n > 0) {
+		int rc = syscall(__NR_io_uring_enter, u->fd, submit, n,
+						 IORING_ENTER_GETEVENTS, NULL, 0);
+		COUNT(syscalls, 1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		submit -= rc;
+
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail && n > 0; ++head, --n) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+			if (cqe->user_data)
+				*(int *)(uintptr_t)cqe->user_data = cqe->res;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+static void uring_batch(struct uring *u, struct ptable *t,
+						const pid_t *pids, int npids)
+{
+	struct uslot *s;
+	int i, f, nslots = 0;
+	unsigned n = 0;
+
+	for (i = 0; i < npids; ++i) {
+		if (pids[i] == me)
+			continue;
+		s = &u->slots[nslots++];
+		s->pid = pids[i];
+		for (f = 0; f < 2; ++f) {
+			snprintf(s->path[f], sizeof(s->path[f]), "%u/%s",
+					 s->pid, f ? "stat" : "cmdline");
+			s->fd[f] = -1;
+			s->n[f] = -1;
+			s->closed[f] = 1;
+			struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_OPENAT, procfd,
+												 s->path[f], &s->fd[f]);
+			sqe->open_flags = O_RDONLY;
+			++n;
+		}
+	}
+
+	if (uring_run(u, n))
+		goto fallback;
+
+	n = 0;
+	for (i = 0; i < nslots; ++i) {
+		s = &u->slots[i];
+		for (f = 0; f < 2; ++f)
+			if (s->fd[f] >= 0) {
+				char *buf = f ? s->stat : s->cmdline;
+				int len = f ? MYPS_STATLEN : MYPS_CMDLEN;
+				struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_READ, s->fd[f],
+													 buf, &s->n[f]);
+				sqe->len = len - 1;
+				sqe->flags = IOSQE_IO_HARDLINK;
+				uring_sqe(u, IORING_OP_CLOSE, s->fd[f], NULL, &s->closed[f]);
+				n += 2;
+			}
+	}
+
+	if (uring_run(u, n))
+		goto fallback;
+
+	for (i = 0; i < nslots; ++i) {
+		struct myps_proc proc;
+
+		s = &u->slots[i];
+		proc.pid = s->pid;
+		if (s->n[0] > 0)
+			COUNT(bytes, s->n[0]);
+		if (s->n[1] <= 0) {
+			fprintf(stderr, "%d: readproc failed\n", s->pid);
+			COUNT(races, 1);
+			continue;
+		}
+		COUNT(bytes, s->n[1]);
+		s->stat[s->n[1]] = 0;
+		if (myps_parse_stat(s->stat, &proc.stat)) {
+			fprintf(stderr, "%d: readstarttime failed\n", s->pid);
+			continue;
+		}
+		if (proc.stat.flags & MYPS_PF_KTHREAD) {
+			COUNT(kthreads, 1);
+			continue;
+		}
+
+		if (s->n[0] <= 0) {
+			if (s->n[0] < 0) {
+				fprintf(stderr, "%d: readproc failed\n", s->pid);
+				COUNT(races, 1);
+			}
+			continue;
+		}
+		s->cmdline[s->n[0]] = 0;
+		myps_cmdline_spaces(s->cmdline, s->n[0]);
+
+		add_cmdline(t, s->cmdline, &proc);
+	}
+	return;
+
+fallback:
+	/* The ring is in an unknown state, do the rest the slow way. Any
+	 * fds the opens returned whose CLOSE never completed are ours.
+	 */
+	for (i = 0; i < nslots; ++i)
+		for (f = 0; f < 2; ++f)
+			if (u->slots[i].fd[f] >= 0 && u->slots[i].closed[f] == 1)
+				close(u->slots[i].fd[f]);
+	uring_free(u);
+	for (i = 0; i < npids; ++i) {
+		struct myps_stat st;
+		add_proc(t, pids[i], &st);
+	}
+}
+#endif
+
+static int use_uring;
+
+/* Threads grab chunks of the pid list until it is exhausted */
+#define CHUNK 64
+
+struct shard {
+	pthread_t tid;
+	struct ptable table;
+	const pid_t *pids;
+	int npids;
+	int *next;
+};
+
+static void scan_pids(struct shard *s, const pid_t *pids, int npids, void *ring)
+{
+#ifdef HAVE_URING
+	struct uring *u = ring;
+	if (u && u->fd >= 0) {
+		uring_batch(u, &s->table, pids, npids);
+		return;
+	}
+#endif
+
+	struct myps_stat st;
+	for (int i = 0; i < npids; ++i)
+		add_proc(&s->table, pids[i], &st);
+}
+
+static void *scan_thread(void *arg)
+{
+	struct shard *s = arg;
+	void *ring = NULL;
+	int i;
+
+#ifdef HAVE_URING
+	struct uring u;
+	if (use_uring && uring_init(&u) == 0)
+		ring = &u;
+#endif
+
+	while ((i = __atomic_fetch_add(s->next, CHUNK, __ATOMIC_RELAXED)) < s->npids) {
+		int n = i + CHUNK < s->npids ? CHUNK : s->npids - i;
+		scan_pids(s, s->pids + i, n, ring);
+	}
+
+#ifdef HAVE_URING
+	if (ring)
+		uring_free(&u);
+#endif
+	return NULL;
+}
+
+static void scan(const pid_t *pids, int npids, int nthreads)
+{
+	if (nthreads <= 1 || npids < CHUNK * 2) {
+		void *ring = NULL;
+#ifdef HAVE_URING
+		struct uring u;
+		if (use_uring && uring_init(&u) == 0)
+			ring = &u;
+		int batch = BATCH;
+#else
+		int batch = npids;
+#endif
+		struct shard s = { .table = table };
+		for (int i = 0; i < npids; i += batch)
+			scan_pids(&s, pids + i, npids - i < batch ? npids - i : batch, ring);
+		table = s.table;
+#ifdef HAVE_URING
+		if (ring)
+			uring_free(&u);
+#endif
+		return;
+	}
+
+	struct shard *shards = xcalloc(nthreads, sizeof(struct shard));
+
+	/* The main thread does its share as shard 0. If a thread cannot
+	 * be created, whatever is left gets picked up by the others.
+	 */
+	int next = 0;
+	for (int i = 0; i < nthreads; ++i) {
+		shards[i].pids = pids;
+		shards[i].npids = npids;
+		shards[i].next = &next;
+		if (i && pthread_create(&shards[i].tid, NULL, scan_thread, &shards[i]))
+			shards[i].npids = 0;
+	}
+
+	scan_thread(&shards[0]);
+
+	for (int i = 0; i < nthreads; ++i) {
+		if (i && shards[i].npids)
+			pthread_join(shards[i].tid, NULL);
+		merge(&table, &shards[i].table);
+	}
+
+	free(shards);
+}
+
+/* The libmyps keys first, then the ones only myps has */
+enum {
+	SORT_START = MYPS_SORT_START, SORT_CPU = MYPS_SORT_CPU, SORT_RSS = MYPS_SORT_RSS,
+	SORT_THREADS = MYPS_SORT_THREADS, SORT_COUNT = MYPS_SORT_COUNT,
+	SORT_WAIT, SORT_IO, SORT_FDS, SORT_PSS
+};
+static int sort_key = -1; /* start, or cpu for -t, unless -s is given */
+static const char *sort_keys[] = {
+	"start", "cpu", "rss", "threads", "count", "wait", "io", "fds", "pss"
+};
+
+static int long_fmt;
+static long pagesize, hz;
+static double interval; /* -t */
+static double elapsed; /* actual time between refreshes */
+
+/* -T: CPU time per thread name for the shown groups. The tasks table
+ * is keyed on the group index, a tab, and the thread name.
+ */
+static int show_threads;
+static struct ptable tasks;
+static int show_fds;
+static int show_pss;
+static void print_tasks(int group);
+
+/* start sorts oldest first, everything else biggest first. The keys
+ * libmyps has, and the ties, are left to myps_group_cmp().
+ */
+static int proc_cmp(const void *a, const void *b)
+{
+	const struct aproc *a1 = a;
+	const struct aproc *b1 = b;
+
+#define BIGGEST(f) if (a1->f != b1->f) return a1->f > b1->f ? -1 : 1
+	switch (sort_key) {
+	case SORT_CPU:
+		if (interval)
+			BIGGEST(dcpu);
+		break;
+	case SORT_WAIT:
+		if (interval)
+			BIGGEST(dwait);
+		BIGGEST(wait_ns);
+		break;
+	case SORT_IO: {
+		const struct ioacct *a_io = interval ? &a1->dio : &a1->io;
+		const struct ioacct *b_io = interval ? &b1->dio : &b1->io;
+		unsigned long long a_bytes = a_io->rbytes + a_io->wbytes;
+		unsigned long long b_bytes = b_io->rbytes + b_io->wbytes;
+		if (a_bytes != b_bytes)
+			return a_bytes > b_bytes ? -1 : 1;
+		break;
+	}
+	case SORT_PSS:
+		BIGGEST(mem.pss);
+		break;
+	case SORT_FDS: {
+		unsigned a_fds = a1->fds.files + a1->fds.sockets + a1->fds.pipes + a1->fds.other;
+		unsigned b_fds = b1->fds.files + b1->fds.sockets + b1->fds.pipes + b1->fds.other;
+		if (a_fds != b_fds)
+			return a_fds > b_fds ? -1 : 1;
+		break;
+	}
+	}
+#undef BIGGEST
+
+	return myps_group_cmp(&a1->g, &b1->g,
+						  sort_key <= MYPS_SORT_COUNT ? sort_key : MYPS_SORT_START);
+}
+
+static int proc_ptr_cmp(const void *a, const void *b)
+{
+	return proc_cmp(*(struct aproc **)a, *(struct aproc **)b);
+}
+
+/* The processes per node they last ran on, like 0:6,1:4. Returns the
+ * number of nodes.
+ */
+static int numa_nodes(const struct numa *numa, char *buf, int len)
+{
+	int n = 0, nodes = 0;
+
+	*buf = 0;
+	for (int i = 0; i < NUMA_NODES && n < len; ++i)
+		if (numa->nodes[i]) {
+			n += snprintf(buf + n, len - n, "%s%d:%u", n ? "," : "", i, numa->nodes[i]);
+			++nodes;
+		}
+	return nodes;
+}
+
+/* A group that ran on more than one node is flagged with a ! */
+static void print_numa(const struct aproc *p)
+{
+	static const struct numa none;
+	const struct numa *numa = p->numa ? p->numa : &none;
+	char nodes[64], ran[64], allowed[64], mems[32];
+
+	int straddles = numa_nodes(numa, nodes, sizeof(nodes)) > 1;
+	format_list(numa->ran, NUMA_CPUS, ran, sizeof(ran));
+	format_list(numa->allowed, NUMA_CPUS, allowed, sizeof(allowed));
+	format_list(&numa->mems, NUMA_NODES, mems, sizeof(mems));
+	printf("%5d %5d %-11s %-12s %-12s %-6s %c %s\n", p->g.pid, p->g.count,
+		   nodes, ran, allowed, mems, straddles ? '!' : ' ', p->g.name);
+}
+
+/* -o json and ndjson. All the output goes through one big buffer so a
+ * listing costs a few writes, and there is no stdio formatting of the
+ * strings.
+ */
+enum { OUT_TEXT, OUT_JSON, OUT_NDJSON };
+static int out_fmt;
+static const char *out_fmts[] = { "text", "json", "ndjson" };
+
+#define OBUF_SIZE 0x100000
+
+static char *obuf;
+static size_t olen;
+static int ofirst; /* no comma before the first json array entry */
+static double boot_epoch; /* wall clock time of boot */
+
+static void oflush(void)
+{
+	for (size_t off = 0; off < olen; ) {
+		ssize_t n = write(1, obuf + off, olen - off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+		off += n;
+	}
+	olen = 0;
+}
+
+/* Make room for n more bytes */
+static void oreserve(size_t n)
+{
+	if (!obuf) {
+		obuf = xrealloc(NULL, OBUF_SIZE);
+	}
+	if (olen + n > OBUF_SIZE)
+		oflush();
+}
+
+static void ocat(const char *s)
+{
+	size_t n = strlen(s);
+
+	oreserve(n);
+	memcpy(obuf + olen, s, n);
+	olen += n;
+}
+
+/* Numbers and the like. Nothing printed this way is long. */
+static void oprintf(const char *fmt, ...)
+{
+	va_list ap;
+
+	oreserve(64);
+	va_start(ap, fmt);
+	olen += vsnprintf(obuf + olen, 64, fmt, ap);
+	va_end(ap);
+}
+
+/* A quoted json string, up to end or the NUL */
+static void ostr(const char *s, const char *end)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	oreserve(1);
+	obuf[olen++] = '"';
+	for (; *s && s != end; ++s) {
+		unsigned char c = *s;
+		oreserve(6);
+		if (c == '"' || c == '\\') {
+			obuf[olen++] = '\\';
+			obuf[olen++] = c;
+		} else if (c < 0x20) {
+			memcpy(obuf + olen, "\\u00", 4);
+			obuf[olen + 4] = hex[c >> 4];
+			obuf[olen + 5] = hex[c & 15];
+			olen += 6;
+		} else
+			obuf[olen++] = c;
+	}
+	oreserve(1);
+	obuf[olen++] = '"';
+}
+
+/* Start a json object, an array entry or a line */
+static void json_open(void)
+{
+	if (out_fmt == OUT_JSON && !ofirst)
+		ocat(",\n");
+	ofirst = 0;
+	ocat("{");
+}
+
+static void json_close(void)
+{
+	ocat(out_fmt == OUT_NDJSON ? "}\n" : "}");
+}
+
+/* The fields of a group, for json_proc() or nested in a cgroup */
+static void json_fields(const struct aproc *p)
+{
+	const char *cmd = p->g.name;
+
+	oprintf("\"pid\":%d,", p->g.pid);
+	if (by_cgroup && strchr(cmd, '\t')) {
+		const char *tab = cmd + strcspn(cmd, "\t");
+		ocat("\"cgroup\":");
+		ostr(cmd, tab);
+		ocat(",");
+		if (*tab)
+			cmd = tab + 1;
+	}
+	ocat("\"cmd\":");
+	ostr(cmd, NULL);
+	oprintf(",\"count\":%d", p->g.count);
+	oprintf(",\"start\":%.2f", boot_epoch + (double)p->g.starttime / hz);
+	oprintf(",\"cpu\":%.2f", (double)p->g.cpu / hz);
+	oprintf(",\"rss\":%lu", p->g.rss * (pagesize / 1024));
+	oprintf(",\"threads\":%d", p->g.threads);
+	if (show_sched) {
+		oprintf(",\"run\":%.3f", p->run_ns / 1e9);
+		oprintf(",\"wait\":%.3f", p->wait_ns / 1e9);
+		oprintf(",\"slices\":%llu", p->slices);
+	}
+	if (p->numa) {
+		char buf[256];
+		int nodes = numa_nodes(p->numa, buf, sizeof(buf));
+		ocat(",\"nodes\":");
+		ostr(buf, NULL);
+		ocat(",\"cpus\":");
+		ostr(format_list(p->numa->ran, NUMA_CPUS, buf, sizeof(buf)), NULL);
+		ocat(",\"allowed\":");
+		ostr(format_list(p->numa->allowed, NUMA_CPUS, buf, sizeof(buf)), NULL);
+		ocat(",\"mems\":");
+		ostr(format_list(&p->numa->mems, NUMA_NODES, buf, sizeof(buf)), NULL);
+		ocat(nodes > 1 ? ",\"straddles\":true" : ",\"straddles\":false");
+	}
+	if (show_pss) {
+		oprintf(",\"pss\":%llu", p->mem.pss);
+		oprintf(",\"uss\":%llu", p->mem.uss);
+		oprintf(",\"swap\":%llu", p->mem.swap);
+	}
+	if (show_fds) {
+		oprintf(",\"files\":%u", p->fds.files);
+		oprintf(",\"sockets\":%u", p->fds.sockets);
+		oprintf(",\"pipes\":%u", p->fds.pipes);
+		oprintf(",\"other_fds\":%u", p->fds.other);
+	}
+	if (show_io) {
+		oprintf(",\"read_bytes\":%llu", p->io.rbytes);
+		oprintf(",\"write_bytes\":%llu", p->io.wbytes);
+		oprintf(",\"syscr\":%llu", p->io.syscr);
+		oprintf(",\"syscw\":%llu", p->io.syscw);
+	}
+	if (interval) {
+		oprintf(",\"pcpu\":%.1f", p->dcpu * 100.0 / (hz * elapsed));
+		oprintf(",\"drss\":%ld",
+				((long)p->g.rss - (long)p->prev_rss) * (long)(pagesize / 1024));
+		if (show_sched)
+			oprintf(",\"wait_ms_per_s\":%.1f", p->dwait / 1e6 / elapsed);
+		if (show_io) {
+			oprintf(",\"read_bytes_per_s\":%.0f", p->dio.rbytes / elapsed);
+			oprintf(",\"write_bytes_per_s\":%.0f", p->dio.wbytes / elapsed);
+			oprintf(",\"syscr_per_s\":%.0f", p->dio.syscr / elapsed);
+			oprintf(",\"syscw_per_s\":%.0f", p->dio.syscw / elapsed);
+		}
+	}
+	if (show_threads && p >= table.procs && p < table.procs + table.curproc)
+		print_tasks(p - table.procs);
+}
+
+static void json_proc(const struct aproc *p)
+{
+	json_open();
+	json_fields(p);
+	json_close();
+}
+
+static void print_header(void)
+{
+	if (out_fmt) {
+		if (out_fmt == OUT_JSON)
+			ocat("[");
+		ofirst = 1;
+	} else if (interval && show_io)
+		puts("  PID COUNT  READ/s WRITE/s SYSCR/s SYSCW/s CMD");
+	else if (interval && show_sched)
+		puts("  PID COUNT  THR  %CPU   WAIT/s CMD");
+	else if (interval)
+		puts("  PID COUNT  THR  %CPU      RSS     dRSS CMD");
+	else if (show_pss)
+		puts("  PID COUNT      RSS      PSS      USS     SWAP CMD");
+	else if (show_numa)
+		puts("  PID COUNT NODES       CPUS         ALLOWED      MEMS   CMD");
+	else if (show_fds)
+		puts("  PID COUNT     FDS    FILE    SOCK    PIPE   OTHER CMD");
+	else if (show_io)
+		puts("  PID COUNT     READ    WRITE    SYSCR    SYSCW CMD");
+	else if (show_sched)
+		puts("  PID COUNT  THR      RUN     WAIT   SLICES  AVGWAIT CMD");
+	else if (long_fmt)
+		puts("  PID COUNT  THR     TIME      RSS CMD");
+}
+
+/* End of a listing. Flushes the output. */
+static void print_footer(void)
+{
+	if (out_fmt) {
+		if (out_fmt == OUT_JSON)
+			ocat("]\n");
+		oflush();
+	} else
+		fflush(stdout);
+}
+
+static void print_proc(const struct aproc *p)
+{
+	if (out_fmt) {
+		json_proc(p);
+		return;
+	}
+
+	if (interval && show_io) {
+		/* KB and syscalls per second */
+		printf("%5d %5d %7.0f %7.0f %7.0f %7.0f %s\n", p->g.pid, p->g.count,
+			   p->dio.rbytes / 1024.0 / elapsed, p->dio.wbytes / 1024.0 / elapsed,
+			   p->dio.syscr / elapsed, p->dio.syscw / elapsed, p->g.name);
+	} else if (interval && show_sched) {
+		/* ms of run queue delay per second, over all the threads */
+		printf("%5d %5d %4d %5.1f %8.1f %s\n",
+			   p->g.pid, p->g.count, p->g.threads,
+			   p->dcpu * 100.0 / (hz * elapsed),
+			   p->dwait / 1e6 / elapsed, p->g.name);
+	} else if (interval) {
+		long kb = pagesize / 1024;
+		printf("%5d %5d %4d %5.1f %8lu %+8ld %s\n",
+			   p->g.pid, p->g.count, p->g.threads,
+			   p->dcpu * 100.0 / (hz * elapsed),
+			   p->g.rss * kb, ((long)p->g.rss - (long)p->prev_rss) * kb, p->g.name);
+	} else if (show_pss) {
+		printf("%5d %5d %8lu %8llu %8llu %8llu %s\n", p->g.pid, p->g.count,
+			   p->g.rss * (pagesize / 1024), p->mem.pss, p->mem.uss, p->mem.swap, p->g.name);
+	} else if (show_numa) {
+		print_numa(p);
+	} else if (show_fds) {
+		const struct fdcount *f = &p->fds;
+		printf("%5d %5d %7u %7u %7u %7u %7u %s\n", p->g.pid, p->g.count,
+			   f->files + f->sockets + f->pipes + f->other,
+			   f->files, f->sockets, f->pipes, f->other, p->g.name);
+	} else if (show_io) {
+		printf("%5d %5d %8llu %8llu %8llu %8llu %s\n", p->g.pid, p->g.count,
+			   p->io.rbytes / 1024, p->io.wbytes / 1024,
+			   p->io.syscr, p->io.syscw, p->g.name);
+	} else if (show_sched) {
+		/* seconds, and the average wait per timeslice in us */
+		printf("%5d %5d %4d %8.2f %8.2f %8llu %8.1f %s\n",
+			   p->g.pid, p->g.count, p->g.threads, p->run_ns / 1e9, p->wait_ns / 1e9,
+			   p->slices, p->slices ? p->wait_ns / 1e3 / p->slices : 0.0, p->g.name);
+	} else if (long_fmt) {
+		unsigned long long secs = p->g.cpu / hz;
+		printf("%5d %5d %4d %2llu:%02llu:%02llu %8lu %s\n",
+			   p->g.pid, p->g.count, p->g.threads,
+			   secs / 3600, (secs / 60) % 60, secs % 60,
+			   p->g.rss * (pagesize / 1024), p->g.name);
+	} else if (p->g.count > 1)
+		printf("%5d %s (%d)\n", p->g.pid, p->g.name, p->g.count);
+	else
+		printf("%5d %s\n", p->g.pid, p->g.name);
+
+	if (show_threads && p >= table.procs && p < table.procs + table.curproc)
+		print_tasks(p - table.procs);
+}
+
+/* The match patterns. Plain patterns are matched in one pass with an
+ * Aho-Corasick automaton, -r patterns are matched with regexec.
+ */
+static char **patterns;
+static int npatterns;
+static int *hits; /* groups matched per pattern */
+/* The last group each pattern was counted for, see is_match() */
+static unsigned *pat_stamp, stamp;
+static int word, use_regex;
+static regex_t *regexes;
+
+struct acnode {
+	int kids; /* first edge */
+	int fail;
+	int dict; /* next node on the fail chain with patterns, 0 if none */
+	int pat; /* first pattern ending here, -1 if none */
+};
+
+struct acedge {
+	int to;
+	int next;
+	unsigned char c;
+};
+
+static struct acnode *ac;
+static struct acedge *edges;
+static int nnodes, nedges;
+static int *pat_next; /* more patterns ending at the same node */
+static int *pat_len;
+
+static int ac_child(int node, unsigned char c)
+{
+	for (int e = ac[node].kids; e >= 0; e = edges[e].next)
+		if (edges[e].c == c)
+			return edges[e].to;
+	return 0;
+}
+
+static int ac_node(void)
+{
+	ac = xrealloc(ac, (nnodes + 1) * sizeof(struct acnode));
+	ac[nnodes] = (struct acnode){ .kids = -1, .pat = -1 };
+	return nnodes++;
+}
+
+static void ac_build(void)
+{
+	pat_next = xrealloc(NULL, npatterns * sizeof(int));
+	pat_len = xrealloc(NULL, npatterns * sizeof(int));
+
+	ac_node(); /* root */
+	for (int i = 0; i < npatterns; ++i) {
+		int node = 0;
+		const unsigned char *s = (const unsigned char *)patterns[i];
+		for (; *s; ++s) {
+			int kid = ac_child(node, *s);
+			if (!kid) {
+				kid = ac_node();
+				edges = xrealloc(edges, (nedges + 1) * sizeof(struct acedge));
+				edges[nedges] = (struct acedge){ .to = kid, .next = ac[node].kids, .c = *s };
+				ac[node].kids = nedges++;
+			}
+			node = kid;
+		}
+		pat_len[i] = s - (const unsigned char *)patterns[i];
+		pat_next[i] = ac[node].pat;
+		ac[node].pat = i;
+	}
+
+	/* Breadth first to set the fail links */
+	int *queue = xrealloc(NULL, nnodes * sizeof(int));
+	int head = 0, tail = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		int node = queue[head++];
+		for (int e = ac[node].kids; e >= 0; e = edges[e].next) {
+			int kid = edges[e].to, fail = 0;
+			if (node) {
+				int f = ac[node].fail;
+				while (f && !ac_child(f, edges[e].c))
+					f = ac[f].fail;
+				fail = ac_child(f, edges[e].c);
+			}
+			ac[kid].fail = fail;
+			ac[kid].dict = ac[fail].pat >= 0 ? fail : ac[fail].dict;
+			queue[tail++] = kid;
+		}
+	}
+	free(queue);
+}
+
+/* Returns 0 on success */
+static int add_pattern(const char *pat)
+{
+	if (!*pat)
+		return 0;
+
+	patterns = xrealloc(patterns, (npatterns + 1) * sizeof(char *));
+	patterns[npatterns] = strdup(pat);
+	if (!patterns[npatterns]) {
+		fputs("Out of memory!\n", stderr);
+		exit(1);
+	}
+	++npatterns;
+	return 0;
+}
+
+static int read_patterns(const char *fname)
+{
+	FILE *fp = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+	if (!fp) {
+		perror(fname);
+		return -1;
+	}
+
+	char line[0x1001];
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = 0;
+		add_pattern(line);
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+	return 0;
+}
+
+/* Returns 0 on success */
+static int compile_patterns(void)
+{
+	hits = xcalloc(npatterns ? npatterns : 1, sizeof(int));
+	pat_stamp = xcalloc(npatterns ? npatterns : 1, sizeof(unsigned));
+
+	if (!use_regex) {
+		ac_build();
+		return 0;
+	}
+
+	regexes = xrealloc(NULL, npatterns * sizeof(regex_t));
+	for (int i = 0; i < npatterns; ++i) {
+		char *pat = patterns[i], *tmp = NULL;
+		if (word) {
+			/* Same as -w for plain patterns: whole basename */
+			tmp = xrealloc(NULL, strlen(pat) + 12);
+			sprintf(tmp, "(^|/)(%s)$", pat);
+			pat = tmp;
+		}
+		int rc = regcomp(&regexes[i], pat, REG_EXTENDED | REG_NOSUB);
+		free(tmp);
+		if (rc) {
+			char err[128];
+			regerror(rc, &regexes[i], err, sizeof(err));
+			fprintf(stderr, "%s: %s\n", patterns[i], err);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Checks every pattern against the group and counts the hits */
+static int is_match(const struct aproc *p)
+{
+	int matched = 0;
+
+	if (use_regex) {
+		for (int i = 0; i < npatterns; ++i)
+			if (regexec(&regexes[i], p->g.name, 0, NULL, 0) == 0) {
+				++hits[i];
+				matched = 1;
+			}
+		return matched;
+	}
+
+	/* Count each pattern once per group. A new stamp per call means
+	 * nothing needs clearing, except when it wraps.
+	 */
+	if (++stamp == 0) {
+		memset(pat_stamp, 0, npatterns * sizeof(unsigned));
+		stamp = 1;
+	}
+
+	const unsigned char *s = (const unsigned char *)p->g.name;
+	int node = 0;
+	for (int i = 0; s[i]; ++i) {
+		while (node && !ac_child(node, s[i]))
+			node = ac[node].fail;
+		node = ac_child(node, s[i]);
+
+		for (int n = ac[node].pat >= 0 ? node : ac[node].dict; n; n = ac[n].dict)
+			for (int pat = ac[n].pat; pat >= 0; pat = pat_next[pat]) {
+				if (pat_stamp[pat] == stamp)
+					continue;
+				if (word) {
+					int start = i - pat_len[pat] + 1;
+					if (!(start == 0 || s[start - 1] == '/'))
+						continue; // mismatch at start
+					if (s[i + 1])
+						continue; // mismatch at end
+				}
+				pat_stamp[pat] = stamp;
+				++hits[pat];
+				matched = 1;
+			}
+	}
+
+	return matched;
+}
+
+int do_match(const struct aproc *p)
+{
+	if (!is_match(p))
+		return 0;
+
+	print_proc(p);
+	return 1;
+}
+
+/* Report the patterns that matched nothing. Returns the exit status. */
+static int report_patterns(void)
+{
+	int missing = 0;
+
+	fflush(stdout);
+	for (int i = 0; i < npatterns; ++i)
+		if (!hits[i]) {
+			if (npatterns > 1)
+				fprintf(stderr, "myps: %s not found\n", patterns[i]);
+			++missing;
+		}
+
+	return missing > 125 ? 125 : missing;
+}
+
+/* The cgroup v2 counters, read once per cgroup. -1 if not available. */
+struct cgstat {
+	long long usage_usec;
+	long long memory;
+	long long pids;
+};
+
+static char cgroup_root[256];
+
+static void find_cgroup_root(void)
+{
+	char line[1024];
+
+	strcpy(cgroup_root, "/sys/fs/cgroup");
+
+	FILE *fp = fopen("/proc/self/mountinfo", "r");
+	if (!fp)
+		return;
+
+	/* id parent dev root mountpoint options ... - fstype source opts */
+	while (fgets(line, sizeof(line), fp)) {
+		char *sep = strstr(line, " - cgroup2 ");
+		if (!sep)
+			continue;
+		char mnt[256];
+		if (sscanf(line, "%*s %*s %*s %*s %255s", mnt) == 1) {
+			strcpy(cgroup_root, mnt);
+			break;
+		}
+	}
+
+	fclose(fp);
+}
+
+static long long read_cgroup(const char *path, const char *file, const char *key)
+{
+	char fname[0x1200], buf[1024];
+
+	snprintf(fname, sizeof(fname), "%s%s/%s", cgroup_root, path, file);
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	int n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+
+	char *p = buf;
+	if (key) {
+		/* key value lines, like cpu.stat */
+		size_t len = strlen(key);
+		for (p = buf; p && *p; ) {
+			if (strncmp(p, key, len) == 0 && p[len] == ' ')
+				break;
+			char *next = strchr(p, '\n');
+			p = next ? next + 1 : NULL;
+		}
+		if (!p || !*p)
+			return -1;
+		p += len + 1;
+	}
+
+	return strtoll(p, NULL, 10);
+}
+
+static void print_cgstat(long long val, long long div)
+{
+	if (val < 0)
+		printf(" %10s", "-");
+	else
+		printf(" %10lld", val / div);
+}
+
+/* groups is sorted. show is the match results, may be NULL. */
+/* One object per cgroup. The counters are left out if the cgroup has
+ * no such file. With -C the command groups, first and then next, are
+ * nested in "cmds".
+ */
+static void json_cgroup(const struct aproc *cg, const struct cgstat *cs,
+						struct aproc **groups, int first, const int *next)
+{
+	json_open();
+	ocat("\"cgroup\":");
+	ostr(cg->g.name, NULL);
+	oprintf(",\"count\":%d", cg->g.count);
+	oprintf(",\"cpu\":%.2f", (double)cg->g.cpu / hz);
+	oprintf(",\"rss\":%lu", cg->g.rss * (pagesize / 1024));
+	oprintf(",\"threads\":%d", cg->g.threads);
+	if (cs->usage_usec >= 0)
+		oprintf(",\"usage_usec\":%lld", cs->usage_usec);
+	if (cs->memory >= 0)
+		oprintf(",\"memory_current\":%lld", cs->memory);
+	if (cs->pids >= 0)
+		oprintf(",\"pids_current\":%lld", cs->pids);
+	if (groups) {
+		ocat(",\"cmds\":[");
+		for (int j = first; j >= 0; j = next[j]) {
+			struct aproc p = *groups[j];
+			p.g.name = strchr(p.g.name, '\t') + 1;
+			ocat(j == first ? "{" : ",{");
+			json_fields(&p);
+			ocat("}");
+		}
+		ocat("]");
+	}
+	json_close();
+}
+
+static void print_cgroups(struct aproc **groups, int ngroups, const char *show)
+{
+	struct ptable cgroups = { 0 };
+	int i, *which = xrealloc(NULL, (ngroups + 1) * sizeof(int));
+
+	find_cgroup_root();
+
+	for (i = 0; i < ngroups; ++i) {
+		struct aproc *p = groups[i];
+		which[i] = -1;
+		if (show && !show[p - table.procs])
+			continue;
+		char path[0x1001];
+		snprintf(path, sizeof(path), "%.*s", (int)strcspn(p->g.name, "\t"), p->g.name);
+		struct aproc *cg = lookup(&cgroups, path, NULL);
+		group(cg, p);
+		which[i] = cg - cgroups.procs;
+	}
+
+	/* Bucket the commands by cgroup, keeping them in sorted order */
+	int *first = xrealloc(NULL, (cgroups.curproc + 1) * sizeof(int));
+	int *next = xrealloc(NULL, (ngroups + 1) * sizeof(int));
+	for (i = 0; i < cgroups.curproc; ++i)
+		first[i] = -1;
+	for (i = ngroups - 1; i >= 0; --i)
+		if (which[i] >= 0) {
+			next[i] = first[which[i]];
+			first[which[i]] = i;
+		}
+
+	/* Sort pointers so the indices into cgroups stay valid */
+	struct aproc **sorted = xrealloc(NULL, (cgroups.curproc + 1) * sizeof(struct aproc *));
+	for (i = 0; i < cgroups.curproc; ++i)
+		sorted[i] = &cgroups.procs[i];
+	qsort(sorted, cgroups.curproc, sizeof(struct aproc *), proc_ptr_cmp);
+
+	if (out_fmt)
+		print_header();
+	else
+		printf("%5s %10s %10s %10s %s\n", "PROCS", "CPU(s)", "MEM(k)", "PIDS", "CGROUP");
+	for (i = 0; i < cgroups.curproc; ++i) {
+		struct aproc *cg = sorted[i];
+		struct cgstat cs = {
+			.usage_usec = read_cgroup(cg->g.name, "cpu.stat", "usage_usec"),
+			.memory = read_cgroup(cg->g.name, "memory.current", NULL),
+			.pids = read_cgroup(cg->g.name, "pids.current", NULL),
+		};
+
+		if (out_fmt) {
+			json_cgroup(cg, &cs, by_cgroup > 1 ? groups : NULL,
+						first[cg - cgroups.procs], next);
+			continue;
+		}
+
+		printf("%5d", cg->g.count);
+		print_cgstat(cs.usage_usec, 1000000);
+		print_cgstat(cs.memory, 1024);
+		print_cgstat(cs.pids, 1);
+		printf(" %s\n", cg->g.name);
+
+		if (by_cgroup > 1)
+			for (int j = first[cg - cgroups.procs]; j >= 0; j = next[j]) {
+				struct aproc p = *groups[j];
+				p.g.name = strchr(p.g.name, '\t') + 1;
+				fputs("    ", stdout);
+				print_proc(&p);
+			}
+	}
+
+	free(sorted);
+	free(first);
+	free(next);
+	free(which);
+	free_procs(&cgroups);
+}
+
+/* -t top mode. Each pid keeps its stat fd open between refreshes
+ * and the grouping table is reused, so a refresh of a known pid is a
+ * single pread.
+ */
+struct pent {
+	pid_t pid;
+	int fd;
+	int group; /* index into table.procs, -1 if not shown */
+	char comm[16];
+	unsigned long long starttime;
+	unsigned long long cpu;
+	unsigned long long wait_ns;
+	struct ioacct io;
+};
+
+static struct pent *pents;
+static int npents;
+
+static double boottime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The comm is between the first ( and the last ) */
+static void stat_comm(const char *buf, char *comm)
+{
+	const char *s = strchr(buf, '(');
+	const char *e = strrchr(buf, ')');
+	int i = 0;
+
+	if (s && e)
+		for (++s; s < e && i < 15; ++s)
+			comm[i++] = *s;
+	comm[i] = 0;
+}
+
+/* Returns 0 if the pid is still alive */
+static int pent_update(struct pent *e, unsigned long long since)
+{
+	char buf[MYPS_CMDLEN], comm[16];
+	struct myps_stat st;
+	int n = -1, fresh = 0;
+
+	if (e->fd >= 0) {
+		n = pread(e->fd, buf, MYPS_STATLEN - 1, 0);
+		COUNT(syscalls, 1);
+		if (n <= 0)
+			return -1; /* it exited */
+	} else {
+		char fname[32];
+		snprintf(fname, sizeof(fname), "%u/stat", e->pid);
+		e->fd = openat(procfd, fname, O_RDONLY);
+		COUNT(syscalls, 1);
+		if (e->fd >= 0) {
+			n = pread(e->fd, buf, MYPS_STATLEN - 1, 0);
+			COUNT(syscalls, 1);
+		} else if (errno == EMFILE || errno == ENFILE)
+			/* Out of fds, fall back to reading it each time */
+			n = myps_readproc(ctx, e->pid, "stat", buf, MYPS_STATLEN);
+		if (n <= 0)
+			return -1;
+	}
+	buf[n] = 0;
+
+	if (myps_parse_stat(buf, &st))
+		return -1;
+
+	stat_comm(buf, comm);
+	if (e->group == -2 || st.starttime != e->starttime ||
+		strcmp(comm, e->comm)) {
+		/* new pid, reused pid, or exec */
+		fresh = e->group == -2 || st.starttime != e->starttime;
+		strcpy(e->comm, comm);
+		e->starttime = st.starttime;
+		e->group = -1;
+		if (!(st.flags & MYPS_PF_KTHREAD) && myps_readcmdline(ctx, e->pid, buf, sizeof(buf)) > 0)
+			e->group = lookup(&table, myps_cmd_name(buf), NULL) - table.procs;
+	}
+
+	unsigned long long cpu = st.utime + st.stime;
+	if (e->group >= 0) {
+		struct aproc *p = &table.procs[e->group];
+		struct myps_proc proc = { .pid = e->pid, .stat = st };
+		struct aproc one = { 0 };
+		myps_group_proc(&one.g, &proc);
+		if (show_sched)
+			read_sched(e->pid, st.num_threads, &one);
+		if (show_io)
+			read_io(e->pid, &one.io);
+		group(p, &one);
+
+		/* Only count all of a new pid's time if it started since
+		 * the last refresh. The wait can go backwards when a thread
+		 * exits.
+		 */
+		if (!fresh) {
+			p->dcpu += cpu - e->cpu;
+			if (one.wait_ns > e->wait_ns)
+				p->dwait += one.wait_ns - e->wait_ns;
+			p->dio.rbytes += one.io.rbytes - e->io.rbytes;
+			p->dio.wbytes += one.io.wbytes - e->io.wbytes;
+			p->dio.syscr += one.io.syscr - e->io.syscr;
+			p->dio.syscw += one.io.syscw - e->io.syscw;
+		} else if (st.starttime >= since) {
+			p->dcpu += cpu;
+			p->dwait += one.wait_ns;
+			p->dio = one.io;
+		}
+		e->wait_ns = one.wait_ns;
+		e->io = one.io;
+	}
+	e->cpu = cpu;
+
+	return 0;
+}
+
+/* Groups are kept after their last pid exits so the next refresh can
+ * reuse them, but a long running -t or -d would then keep every
+ * command it ever saw. Rebuild the table without the empty groups
+ * once they outnumber the live ones.
+ */
+static void compact_groups(void)
+{
+	int i, live = 0;
+
+	for (i = 0; i < table.curproc; ++i)
+		if (table.procs[i].g.count)
+			++live;
+	if (table.curproc < 256 || live * 2 >= table.curproc)
+		return;
+
+	struct ptable t = { 0 };
+	int *map = xrealloc(NULL, table.curproc * sizeof(int));
+	for (i = 0; i < table.curproc; ++i) {
+		struct aproc *p = &table.procs[i];
+		if (p->g.count == 0) {
+			map[i] = -1;
+			continue;
+		}
+		struct aproc *q = lookup(&t, p->g.name, NULL);
+		const char *cmd = q->g.name;
+		*q = *p;
+		q->g.name = cmd;
+		p->numa = NULL; /* moved to q */
+		map[i] = q - t.procs;
+	}
+
+	for (i = 0; i < npents; ++i)
+		if (pents[i].group >= 0)
+			pents[i].group = map[pents[i].group];
+	for (i = 0; i < table.nmembers; ++i)
+		table.members[i].group = map[table.members[i].group];
+	t.members = table.members;
+	t.nmembers = table.nmembers;
+	t.maxmembers = table.maxmembers;
+	table.members = NULL;
+
+	free_procs(&table);
+	table = t;
+	free(map);
+}
+
+static void refresh(const pid_t *pids, int npids, unsigned long long since)
+{
+	struct pent *old = pents;
+	int i, nold = npents;
+
+	/* Hash the old entries by pid, index + 1, zero is empty */
+	unsigned size = 1024;
+	while (size < nold * 2)
+		size *= 2;
+	int *hash = xcalloc(size, sizeof(int));
+	for (i = 0; i < nold; ++i) {
+		unsigned h = old[i].pid & (size - 1);
+		while (hash[h])
+			h = (h + 1) & (size - 1);
+		hash[h] = i + 1;
+	}
+
+	for (i = 0; i < table.curproc; ++i) {
+		struct aproc *p = &table.procs[i];
+		p->prev_rss = p->g.rss;
+		p->g.count = 0;
+		p->g.cpu = p->dcpu = 0;
+		p->g.rss = 0;
+		p->g.threads = 0;
+		p->run_ns = p->wait_ns = p->slices = p->dwait = 0;
+		memset(&p->io, 0, sizeof(p->io));
+		memset(&p->dio, 0, sizeof(p->dio));
+	}
+
+	pents = xrealloc(NULL, (npids ? npids : 1) * sizeof(struct pent));
+	npents = 0;
+
+	for (i = 0; i < npids; ++i) {
+		struct pent *e = &pents[npents];
+		if (pids[i] == me)
+			continue;
+
+		e->pid = pids[i];
+		e->fd = -1;
+		e->group = -2;
+		e->wait_ns = 0;
+		memset(&e->io, 0, sizeof(e->io));
+		for (unsigned h = e->pid & (size - 1); hash[h]; h = (h + 1) & (size - 1))
+			if (old[hash[h] - 1].pid == e->pid) {
+				*e = old[hash[h] - 1];
+				old[hash[h] - 1].pid = 0;
+				break;
+			}
+
+		if (pent_update(e, since) == 0)
+			++npents;
+		else if (e->fd >= 0)
+			close(e->fd);
+	}
+
+	/* Whatever is left has exited */
+	for (i = 0; i < nold; ++i)
+		if (old[i].pid && old[i].fd >= 0)
+			close(old[i].fd);
+
+	free(old);
+	free(hash);
+	compact_groups();
+}
+
+/* Sort the non-empty groups without moving them, so the hash and any
+ * indices into table.procs stay valid. The caller frees the array.
+ */
+static struct aproc **sort_groups(int *ngroups, int *nprocs)
+{
+	struct aproc **sorted = xrealloc(NULL, (table.curproc + 1) * sizeof(struct aproc *));
+	int n = 0, procs = 0;
+
+	for (int i = 0; i < table.curproc; ++i)
+		if (table.procs[i].g.count) {
+			sorted[n++] = &table.procs[i];
+			procs += table.procs[i].g.count;
+		}
+	qsort(sorted, n, sizeof(struct aproc *), proc_ptr_cmp);
+
+	*ngroups = n;
+	if (nprocs)
+		*nprocs = procs;
+	return sorted;
+}
+
+/* refresh() wants an fd per pid */
+static void raise_nofile(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+}
+
+static void sleep_for(double secs)
+{
+	struct timespec ts = {
+		.tv_sec = secs,
+		.tv_nsec = (secs - (long)secs) * 1e9,
+	};
+	while (nanosleep(&ts, &ts) && errno == EINTR) ;
+}
+
+/* --save, --record, and --diff. A file is a header and then records,
+ * each a u32 length (including itself), a type, the time, and a list of
+ * groups. Groups are numbered in the order they first appear. A key
+ * record starts the numbering over and has every group, a delta record
+ * only has the groups that changed since the previous record, as
+ * zigzag varint deltas. A group's cmd is only written when it is new,
+ * so each string is stored once per key.
+ *
+ * --save writes one key record. --record appends to a fixed size ring:
+ * the oldest records are dropped to make room and a key is written
+ * every REC_KEY_EVERY records, so the ring can be decoded from the
+ * first key after its tail.
+ */
+#define REC_MAGIC "MYPSREC1"
+#define REC_KEY_EVERY 64
+#define REC_NVALS 6
+
+struct rec_hdr {
+	char magic[8];
+	uint64_t size; /* of the ring data, 0 for a --save file */
+	uint64_t head, tail; /* offsets into the data */
+	uint64_t nrecs;
+};
+
+enum { REC_KEY, REC_DELTA };
+
+static const char *save_file, *record_file;
+static uint64_t ring_size = 64 << 20;
+
+struct wbuf {
+	unsigned char *data;
+	size_t len, max;
+};
+
+static void wbuf_put(struct wbuf *b, const void *data, size_t len)
+{
+	if (b->len + len > b->max) {
+		b->max = (b->len + len) * 2;
+		b->data = xrealloc(b->data, b->max);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void wbuf_varint(struct wbuf *b, uint64_t v)
+{
+	unsigned char buf[10];
+	int n = 0;
+
+	do {
+		buf[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v);
+	wbuf_put(b, buf, n);
+}
+
+static uint64_t get_varint(const unsigned char **p, const unsigned char *end)
+{
+	uint64_t v = 0;
+
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char c = *(*p)++;
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			break;
+	}
+	return v;
+}
+
+static void rec_vals(const struct aproc *p, int64_t *v)
+{
+	v[0] = p->g.count;
+	v[1] = p->g.pid;
+	v[2] = p->g.starttime;
+	v[3] = p->g.cpu;
+	v[4] = p->g.rss;
+	v[5] = p->g.threads;
+}
+
+static void rec_set(struct aproc *p, const int64_t *v)
+{
+	p->g.count = v[0];
+	p->g.pid = v[1];
+	p->g.starttime = v[2];
+	p->g.cpu = v[3];
+	p->g.rss = v[4];
+	p->g.threads = v[5];
+}
+
+/* Append table to b as a record against the previous values in ids,
+ * which are updated. ids is emptied first for a key.
+ */
+static void rec_encode(struct wbuf *b, struct ptable *ids, int type)
+{
+	size_t start = b->len;
+
+	if (type == REC_KEY)
+		free_procs(ids);
+
+	int old = ids->curproc;
+	int *cur = xrealloc(NULL, (old + table.curproc + 1) * sizeof(int));
+	for (int i = 0; i < old; ++i)
+		cur[i] = -1;
+	for (int i = 0; i < table.curproc; ++i)
+		if (table.procs[i].g.count) {
+			struct aproc *id = lookup(ids, table.procs[i].g.name, NULL);
+			cur[id - ids->procs] = i;
+		}
+
+	uint32_t len = 0;
+	wbuf_put(b, &len, sizeof(len)); /* filled in below */
+	wbuf_varint(b, type);
+	wbuf_varint(b, time(NULL));
+
+	/* Count first, then the entries */
+	int n = 0;
+	int64_t prev[REC_NVALS], now[REC_NVALS] = { 0 };
+	char *changed = xcalloc(ids->curproc + 1, 1);
+	for (int i = 0; i < ids->curproc; ++i) {
+		rec_vals(&ids->procs[i], prev);
+		if (cur[i] >= 0)
+			rec_vals(&table.procs[cur[i]], now);
+		else
+			memset(now, 0, sizeof(now));
+		if (i >= old || memcmp(prev, now, sizeof(now))) {
+			changed[i] = 1;
+			++n;
+		}
+	}
+	wbuf_varint(b, n);
+
+	for (int i = 0; i < ids->curproc; ++i) {
+		if (!changed[i])
+			continue;
+		rec_vals(&ids->procs[i], prev);
+		if (cur[i] >= 0)
+			rec_vals(&table.procs[cur[i]], now);
+		else
+			memset(now, 0, sizeof(now));
+
+		wbuf_varint(b, i);
+		if (i >= old)
+			wbuf_put(b, ids->procs[i].g.name, strlen(ids->procs[i].g.name) + 1);
+		for (int v = 0; v < REC_NVALS; ++v) {
+			int64_t d = now[v] - prev[v];
+			wbuf_varint(b, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+		}
+		rec_set(&ids->procs[i], now);
+	}
+
+	len = b->len - start;
+	memcpy(b->data + start, &len, sizeof(len));
+	free(changed);
+	free(cur);
+}
+
+/* Apply one record to t */
+static void rec_decode(struct ptable *t, const unsigned char *p,
+					   const unsigned char *end)
+{
+	uint64_t type = get_varint(&p, end);
+	get_varint(&p, end); /* the time */
+	uint64_t n = get_varint(&p, end);
+
+	/* Each group takes at least an index and the values */
+	if (n > (end - p) / (1 + REC_NVALS))
+		return; /* corrupt */
+
+	if (type == REC_KEY)
+		free_procs(t);
+
+	for (; n > 0 && p < end; --n) {
+		uint64_t i = get_varint(&p, end);
+		if (i > t->curproc)
+			break; /* corrupt */
+		if (i == t->curproc) {
+			const unsigned char *nul = memchr(p, 0, end - p);
+			if (!nul)
+				break;
+			lookup(t, (const char *)p, NULL);
+			if (t->curproc != i + 1)
+				break; /* a duplicate, corrupt */
+			p = nul + 1;
+		}
+
+		int64_t v[REC_NVALS];
+		rec_vals(&t->procs[i], v);
+		for (int j = 0; j < REC_NVALS; ++j) {
+			uint64_t z = get_varint(&p, end);
+			v[j] += (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+		}
+		rec_set(&t->procs[i], v);
+	}
+}
+
+/* Walk the records of a mapped file, oldest first */
+struct rec_iter {
+	const unsigned char *data;
+	uint64_t size, pos;
+	uint64_t left; /* records in a ring, bytes in a --save file */
+};
+
+static int rec_next(struct rec_iter *it, const unsigned char **rec, uint32_t *len)
+{
+	if (it->left == 0)
+		return 0;
+
+	if (!it->size) {
+		if (it->left < 4)
+			return 0;
+		memcpy(len, it->data + it->pos, 4);
+		if (*len < 4 || *len > it->left)
+			return 0;
+		it->left -= *len;
+	} else {
+		/* A zero length, or no room for one, wraps the ring */
+		*len = 0;
+		if (it->pos + 4 <= it->size)
+			memcpy(len, it->data + it->pos, 4);
+		if (*len == 0) {
+			it->pos = 0;
+			memcpy(len, it->data, 4);
+		}
+		if (*len < 4 || it->pos + *len > it->size)
+			return 0;
+		--it->left;
+	}
+
+	*rec = it->data + it->pos + 4;
+	it->pos += *len;
+	return 1;
+}
+
+/* Load the last snapshot at or before until (0 for the latest) from a
+ * --save or --record file into t. Returns the snapshot time, 0 if
+ * there was none.
+ */
+static uint64_t rec_load(const char *fname, uint64_t until, struct ptable *t)
+{
+	int fd = open(fname, O_RDONLY);
+	struct stat sb;
+	if (fd < 0 || fstat(fd, &sb)) {
+		perror(fname);
+		exit(1);
+	}
+
+	struct rec_hdr hdr;
+	if (sb.st_size < sizeof(hdr) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		memcmp(hdr.magic, REC_MAGIC, 8) ||
+		(hdr.size && (hdr.size + sizeof(hdr) > sb.st_size || hdr.tail >= hdr.size))) {
+		fprintf(stderr, "%s: not a myps snapshot\n", fname);
+		exit(1);
+	}
+
+	unsigned char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(fname);
+		exit(1);
+	}
+
+	struct rec_iter it = {
+		.data = map + sizeof(hdr),
+		.size = hdr.size,
+		.pos = hdr.size ? hdr.tail : 0,
+		.left = hdr.size ? hdr.nrecs : sb.st_size - sizeof(hdr),
+	};
+
+	/* Decode into a scratch table and keep the last good state */
+	struct ptable cur = { 0 };
+	const unsigned char *rec;
+	uint32_t len;
+	uint64_t when = 0;
+	int keyed = 0;
+	while (rec_next(&it, &rec, &len)) {
+		const unsigned char *p = rec;
+		int type = get_varint(&p, rec + len - 4);
+		uint64_t rtime = get_varint(&p, rec + len - 4);
+		if (type == REC_KEY)
+			keyed = 1;
+		if (!keyed)
+			continue; /* the key it needs was dropped */
+		if (until && rtime > until)
+			break;
+		rec_decode(&cur, rec, rec + len - 4);
+		when = rtime;
+	}
+
+	munmap(map, sb.st_size);
+	free_procs(t);
+	*t = cur;
+	return when;
+}
+
+/* The recorder state. ids has the values of the previous record. */
+static struct {
+	int fd;
+	struct rec_hdr hdr;
+	struct ptable ids;
+	int since_key;
+} rec = { .fd = -1 };
+
+static void rec_write_hdr(void)
+{
+	if (pwrite(rec.fd, &rec.hdr, sizeof(rec.hdr), 0) != sizeof(rec.hdr)) {
+		perror(record_file);
+		exit(1);
+	}
+}
+
+static void rec_open(void)
+{
+	rec.fd = open(record_file, O_RDWR | O_CREAT, 0644);
+	if (rec.fd < 0 || flock(rec.fd, LOCK_EX | LOCK_NB)) {
+		perror(record_file);
+		exit(1);
+	}
+
+	if (pread(rec.fd, &rec.hdr, sizeof(rec.hdr), 0) == sizeof(rec.hdr) &&
+		memcmp(rec.hdr.magic, REC_MAGIC, 8) == 0 && rec.hdr.size) {
+		/* Carry on from the last record, so a run from cron can
+		 * still write a delta.
+		 */
+		uint64_t when = rec_load(record_file, 0, &rec.ids);
+		rec.since_key = when ? 1 : REC_KEY_EVERY;
+		return;
+	}
+
+	memset(&rec.hdr, 0, sizeof(rec.hdr));
+	memcpy(rec.hdr.magic, REC_MAGIC, 8);
+	rec.hdr.size = ring_size;
+	if (ftruncate(rec.fd, sizeof(rec.hdr) + ring_size)) {
+		perror(record_file);
+		exit(1);
+	}
+	rec_write_hdr();
+	rec.since_key = REC_KEY_EVERY;
+}
+
+/* The record length at pos, zero for the wrap */
+static uint32_t rec_len_at(uint64_t pos)
+{
+	uint32_t len = 0;
+
+	if (pos + 4 <= rec.hdr.size &&
+		pread(rec.fd, &len, 4, sizeof(rec.hdr) + pos) != 4)
+		len = 0;
+	return len;
+}
+
+/* Drop the oldest record */
+static void rec_drop(void)
+{
+	struct rec_hdr *h = &rec.hdr;
+
+	h->tail += rec_len_at(h->tail);
+	if (--h->nrecs == 0)
+		h->tail = h->head;
+	else if (rec_len_at(h->tail) == 0)
+		h->tail = 0;
+}
+
+/* Append the table to the ring */
+static void record(void)
+{
+	struct wbuf b = { 0 };
+	int key = rec.since_key >= REC_KEY_EVERY;
+
+	rec_encode(&b, &rec.ids, key ? REC_KEY : REC_DELTA);
+	rec.since_key = key ? 1 : rec.since_key + 1;
+	if (b.len > rec.hdr.size / 2) {
+		fprintf(stderr, "%s: ring too small\n", record_file);
+		exit(1);
+	}
+
+	struct rec_hdr *h = &rec.hdr;
+	if (h->head + b.len > h->size) {
+		/* The records from head to the end are the oldest, the wrap
+		 * drops them.
+		 */
+		while (h->nrecs && h->tail >= h->head)
+			rec_drop();
+		if (h->head + 4 <= h->size) {
+			uint32_t zero = 0;
+			if (pwrite(rec.fd, &zero, 4, sizeof(*h) + h->head) != 4) {
+				perror(record_file);
+				exit(1);
+			}
+		}
+		h->head = 0;
+	}
+	while (h->nrecs && h->tail >= h->head && h->tail < h->head + b.len)
+		rec_drop();
+
+	if (pwrite(rec.fd, b.data, b.len, sizeof(*h) + h->head) != b.len) {
+		perror(record_file);
+		exit(1);
+	}
+	if (h->nrecs++ == 0)
+		h->tail = h->head;
+	h->head += b.len;
+	rec_write_hdr();
+	free(b.data);
+}
+
+static void save(void)
+{
+	struct rec_hdr hdr = { .magic = REC_MAGIC };
+	struct ptable ids = { 0 };
+	struct wbuf b = { 0 };
+
+	wbuf_put(&b, &hdr, sizeof(hdr));
+	rec_encode(&b, &ids, REC_KEY);
+
+	int fd = open(save_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, b.data, b.len) != b.len || close(fd)) {
+		perror(save_file);
+		exit(1);
+	}
+	free(b.data);
+	free_procs(&ids);
+}
+
+/* file or file@time, time in seconds since the epoch */
+static uint64_t rec_load_arg(const char *arg, struct ptable *t)
+{
+	char *fname = strdup(arg);
+	if (!fname) {
+		fputs("Out of memory!\n", stderr);
+		exit(1);
+	}
+	char *at = strrchr(fname, '@');
+	uint64_t until = 0;
+
+	if (at && at[1] && strspn(at + 1, "0123456789") == strlen(at + 1)) {
+		until = strtoull(at + 1, NULL, 10);
+		*at = 0;
+	}
+
+	uint64_t when = rec_load(fname, until, t);
+	if (!when) {
+		fprintf(stderr, "%s: no snapshot%s\n", arg, until ? " by then" : "");
+		exit(1);
+	}
+	free(fname);
+	return when;
+}
+
+static void diff_line(int what, const struct aproc *p, int old)
+{
+	if (npatterns && !is_match(p))
+		return;
+
+	if (what == '~')
+		printf("~ %5d %s (%d -> %d)\n", p->g.pid, p->g.name, old, p->g.count);
+	else
+		printf("%c %5d %s (%d)\n", what, p->g.pid, p->g.name, p->g.count);
+}
+
+/* --diff: groups that appeared, went away, or changed count */
+static void diff(const char *from, const char *to)
+{
+	struct ptable a = { 0 }, b = { 0 };
+
+	rec_load_arg(from, &a);
+	rec_load_arg(to, &b);
+
+	/* lookup adds the misses, with a zero count */
+	int na = a.curproc, nb = b.curproc;
+	for (int i = 0; i < nb; ++i) {
+		struct aproc *q = &b.procs[i];
+		if (!q->g.count)
+			continue;
+		struct aproc *p = lookup(&a, q->g.name, NULL);
+		if (!p->g.count)
+			diff_line('+', q, 0);
+		else if (p->g.count != q->g.count)
+			diff_line('~', q, p->g.count);
+	}
+	for (int i = 0; i < na; ++i) {
+		struct aproc *p = &a.procs[i];
+		if (p->g.count && !lookup(&b, p->g.name, NULL)->g.count)
+			diff_line('-', p, 0);
+	}
+	fflush(stdout);
+
+	free_procs(&a);
+	free_procs(&b);
+}
+
+static void top(int iterations)
+{
+	const pid_t *pids;
+	int rows = 0;
+
+	raise_nofile();
+
+	double last = boottime();
+	int npids = read_pids(&pids);
+	refresh(pids, npids, last * hz);
+
+	for (int n = 0; iterations == 0 || n < iterations; ++n) {
+		sleep_for(interval);
+
+		unsigned long syscalls = total_syscalls(NULL);
+		double now = boottime();
+		npids = read_pids(&pids);
+		refresh(pids, npids, last * hz);
+		elapsed = now - last;
+		last = now;
+
+		if (record_file) {
+			record();
+			continue;
+		}
+
+		int nsorted, nprocs;
+		struct aproc **sorted = sort_groups(&nsorted, &nprocs);
+
+		if (out_fmt)
+			;
+		else if (isatty(1)) {
+			struct winsize ws;
+			if (ioctl(1, TIOCGWINSZ, &ws) == 0)
+				rows = ws.ws_row - 3;
+			fputs("\033[H\033[2J", stdout);
+		} else if (n)
+			putchar('\n');
+
+		if (!out_fmt)
+			printf("myps: %d groups, %d procs, %lu syscalls\n", nsorted, nprocs,
+				   total_syscalls(NULL) - syscalls);
+		print_header();
+		for (int i = 0, lines = 0; i < nsorted && (rows <= 0 || lines < rows); ++i)
+			if (npatterns)
+				lines += do_match(sorted[i]);
+			else {
+				print_proc(sorted[i]);
+				++lines;
+			}
+		print_footer();
+
+		free(sorted);
+	}
+
+}
+
+/* Run fn over the items [0, n) on nthreads threads. Each thread
+ * groups into its own table and they are merged into dst at the end.
+ */
+struct pwork {
+	pthread_t tid;
+	int started;
+	struct ptable table;
+	void (*fn)(struct pwork *w, int item);
+	void *arg;
+	int n;
+	int *next;
+	char *dents; /* getdents64 buffer, allocated on first use */
+};
+
+#define PCHUNK 16
+
+static void *pwork_thread(void *arg)
+{
+	struct pwork *w = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(w->next, PCHUNK, __ATOMIC_RELAXED)) < w->n) {
+		int end = i + PCHUNK < w->n ? i + PCHUNK : w->n;
+		for (; i < end; ++i)
+			w->fn(w, i);
+	}
+
+	free(w->dents);
+	w->dents = NULL;
+	return NULL;
+}
+
+static void parallel(struct ptable *dst, int n, int nthreads,
+					 void (*fn)(struct pwork *w, int item), void *arg)
+{
+	if (nthreads > n / PCHUNK)
+		nthreads = n / PCHUNK + 1;
+
+	struct pwork *w = xcalloc(nthreads, sizeof(struct pwork));
+
+	/* As with scan(), the main thread is worker 0 */
+	int next = 0;
+	for (int i = 0; i < nthreads; ++i) {
+		w[i].fn = fn;
+		w[i].arg = arg;
+		w[i].n = n;
+		w[i].next = &next;
+		if (i)
+			w[i].started = pthread_create(&w[i].tid, NULL, pwork_thread, &w[i]) == 0;
+	}
+
+	pwork_thread(&w[0]);
+
+	for (int i = 0; i < nthreads; ++i) {
+		if (w[i].started)
+			pthread_join(w[i].tid, NULL);
+		merge(dst, &w[i].table);
+	}
+
+	free(w);
+}
+
+static int max_threads = 10000; /* per process */
+
+struct task {
+	pid_t pid, tid;
+	int group;
+};
+
+/* Thread pools number their threads, GC Thread#3, pool-1-thread-12,
+ * so drop the number to lump them together.
+ */
+static void thread_name(char *name)
+{
+	int n = strlen(name);
+
+	while (n > 1 && isdigit(name[n - 1]))
+		--n;
+	if (n > 1 && strchr("#-_:/ ", name[n - 1]))
+		--n;
+	name[n] = 0;
+}
+
+static void read_task(struct pwork *w, int i)
+{
+	struct task *task = (struct task *)w->arg + i;
+	char file[32], buf[MYPS_STATLEN], name[16], key[32];
+	struct myps_stat st;
+
+	snprintf(file, sizeof(file), "task/%d/stat", task->tid);
+	if (myps_readproc(ctx, task->pid, file, buf, sizeof(buf)) <= 0 || myps_parse_stat(buf, &st))
+		return; /* it exited */
+
+	stat_comm(buf, name);
+	thread_name(name);
+	snprintf(key, sizeof(key), "%d\t%s", task->group, name);
+
+	struct aproc one = {
+		.g.count = 1,
+		.g.pid = task->tid,
+		.g.starttime = st.starttime,
+		.g.cpu = st.utime + st.stime,
+		.g.threads = 1,
+	};
+	group(lookup(&w->table, key, NULL), &one);
+}
+
+struct tasklist {
+	struct task *list;
+	int n, max, skipped;
+	int got; /* for this member */
+	const struct member *m;
+};
+
+static int add_task(const char *name, void *arg)
+{
+	struct tasklist *l = arg;
+
+	if (l->got >= max_threads) {
+		++l->skipped;
+		return 0;
+	}
+	if (l->n >= l->max) {
+		l->max = l->max ? l->max * 2 : 1024;
+		l->list = xrealloc(l->list, l->max * sizeof(struct task));
+	}
+	l->list[l->n].pid = l->m->pid;
+	l->list[l->n].tid = strtol(name, NULL, 10);
+	l->list[l->n].group = l->m->group;
+	++l->n;
+	++l->got;
+	return 0;
+}
+
+static void read_tasks(struct ptable *tasks, const char *show, int nthreads)
+{
+	struct tasklist l = { 0 };
+
+	char *buf = xrealloc(NULL, MYPS_DENTSLEN);
+
+	/* Listing is one getdents64 per process, the reads are the
+	 * expensive part and they are done in parallel.
+	 */
+	for (int i = 0; i < table.nmembers; ++i) {
+		struct member *m = &table.members[i];
+		if (show && !show[m->group])
+			continue;
+
+		char dir[32];
+		snprintf(dir, sizeof(dir), "%u/task", m->pid);
+		int fd = openat(procfd, dir, O_RDONLY | O_DIRECTORY);
+		COUNT(syscalls, 1);
+		if (fd < 0)
+			continue;
+
+		l.got = 0;
+		l.m = m;
+		myps_readdir(ctx, fd, buf, MYPS_DENTSLEN, add_task, &l);
+		close(fd);
+		COUNT(syscalls, 1);
+	}
+	free(buf);
+
+	if (l.skipped)
+		fprintf(stderr, "myps: %d threads over the %d per process limit not read\n",
+				l.skipped, max_threads);
+
+	parallel(tasks, l.n, nthreads, read_task, l.list);
+	free(l.list);
+}
+
+static int task_cmp(const void *a, const void *b)
+{
+	const struct aproc *a1 = *(struct aproc **)a;
+	const struct aproc *b1 = *(struct aproc **)b;
+
+	if (a1->g.cpu != b1->g.cpu)
+		return a1->g.cpu > b1->g.cpu ? -1 : 1;
+	return strcmp(a1->g.name, b1->g.name);
+}
+
+static void print_tasks(int group)
+{
+	struct aproc **list = xrealloc(NULL, (tasks.curproc + 1) * sizeof(struct aproc *));
+	int n = 0;
 
-static pid_t me;
+	/* Groups have at most a handful of thread names, a linear pass
+	 * per group is fine.
+	 */
+	for (int i = 0; i < tasks.curproc; ++i)
+		if (strtol(tasks.procs[i].g.name, NULL, 10) == group)
+			list[n++] = &tasks.procs[i];
+	qsort(list, n, sizeof(struct aproc *), task_cmp);
+
+	if (out_fmt)
+		ocat(",\"tasks\":[");
+	for (int i = 0; i < n; ++i) {
+		const char *name = strchr(list[i]->g.name, '\t') + 1;
+		if (out_fmt) {
+			ocat(i ? ",{\"name\":" : "{\"name\":");
+			ostr(name, NULL);
+			oprintf(",\"count\":%d,\"cpu\":%.2f}", list[i]->g.count,
+					(double)list[i]->g.cpu / hz);
+			continue;
+		}
+		unsigned long long secs = list[i]->g.cpu / hz;
+		printf("      %5d %3llu:%02llu:%02llu %s\n", list[i]->g.count,
+			   secs / 3600, (secs / 60) % 60, secs % 60, name);
+	}
+	if (out_fmt)
+		ocat("]");
+
+	free(list);
+}
+
+/* --fds. The fd dirs are read in parallel, one pid at a time, and
+ * summed straight into the groups. readlink is the only way to tell a
+ * socket from a file, so it costs a syscall per fd.
+ */
 
-static int readproc(pid_t pid, const char *file, char *buf, int len)
+struct fddir {
+	int fd;
+	struct fdcount fds;
+};
+
+static int add_fd(const char *name, void *arg)
 {
-	char fname[32];
-	int fd, n;
+	struct fddir *d = arg;
+	char link[16];
 
-	*buf = 0;
+	int n = readlinkat(d->fd, name, link, sizeof(link));
+	COUNT(syscalls, 1);
+	if (n <= 0)
+		return 0; /* closed since the getdents */
+	if (*link == '/')
+		++d->fds.files;
+	else if (n > 7 && strncmp(link, "socket:", 7) == 0)
+		++d->fds.sockets;
+	else if (n > 5 && strncmp(link, "pipe:", 5) == 0)
+		++d->fds.pipes;
+	else
+		++d->fds.other;
+	return 0;
+}
 
-	snprintf(fname, sizeof(fname), "/proc/%u/%s", pid, file);
-	fd = open(fname, O_RDONLY);
-	if (fd < 0)
-		return -1;
-	n = read(fd, buf, len - 1);
-	close(fd);
+static void read_fd_dir(struct pwork *w, int i)
+{
+	struct member *m = ((struct member **)w->arg)[i];
+	struct fddir d = { 0 };
+	char dir[32];
 
-	/* Zero length is not an error. Some files, like a kernel thread
-	 * cmdline, are zero length.
-	 */
-	if (n < 0)
-		return -1;
+	if (!w->dents)
+		w->dents = xrealloc(NULL, MYPS_DENTSLEN);
 
-	buf[n] = 0;
-	return n;
+	snprintf(dir, sizeof(dir), "%u/fd", m->pid);
+	d.fd = openat(procfd, dir, O_RDONLY | O_DIRECTORY);
+	COUNT(syscalls, 1);
+	if (d.fd < 0)
+		return; /* exited, or someone else's */
+
+	myps_readdir(ctx, d.fd, w->dents, MYPS_DENTSLEN, add_fd, &d);
+	close(d.fd);
+	COUNT(syscalls, 1);
+
+	struct fdcount fds = d.fds;
+	struct fdcount *sum = &table.procs[m->group].fds;
+	__atomic_add_fetch(&sum->files, fds.files, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sum->sockets, fds.sockets, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sum->pipes, fds.pipes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sum->other, fds.other, __ATOMIC_RELAXED);
 }
 
-/* Note: /proc/pid/cmdline is limited to 4k */
-static int readproccmdline(pid_t pid, char *buf, int len)
+/* --pss. smaps_rollup walks the page tables under the mm lock, so it is
+ * the slowest file in /proc by far. The reads are spread over the -j
+ * threads and only done for the shown groups.
+ */
+static void read_rollup(struct pwork *w, int i)
 {
-	int i, n = readproc(pid, "cmdline", buf, len);
+	struct member *m = ((struct member **)w->arg)[i];
+	struct memacct mem = { 0 };
+	char buf[0x1000];
+
+	if (myps_readproc(ctx, m->pid, "smaps_rollup", buf, sizeof(buf)) <= 0)
+		return; /* exited, someone else's, or a kernel without it */
 
-	if (n > 0)
-		for (i = 0; i < n - 1; ++i)
-			if (buf[i] == 0)
-				buf[i] = ' ';
+	for (char *line = strchr(buf, '\n'); line; line = strchr(line, '\n')) {
+		++line;
+		char *val = strchr(line, ':');
+		if (!val)
+			break;
+		unsigned long long kb = strtoull(val + 1, NULL, 10);
+		if (strncmp(line, "Pss:", 4) == 0)
+			mem.pss = kb;
+		else if (strncmp(line, "Private_Clean:", 14) == 0 ||
+				 strncmp(line, "Private_Dirty:", 14) == 0)
+			mem.uss += kb;
+		else if (strncmp(line, "Swap:", 5) == 0)
+			mem.swap = kb;
+	}
 
-	return n;
+	struct memacct *sum = &table.procs[m->group].mem;
+	__atomic_add_fetch(&sum->pss, mem.pss, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sum->uss, mem.uss, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sum->swap, mem.swap, __ATOMIC_RELAXED);
 }
 
-static unsigned long long readstarttime(pid_t pid)
+/* Run fn over the members of the shown groups */
+static void for_members(const char *show, int nthreads,
+						void (*fn)(struct pwork *w, int item))
 {
-	char buf[128];
+	struct member **list = xrealloc(NULL, (table.nmembers + 1) * sizeof(struct member *));
+	struct ptable unused = { 0 };
+	int n = 0;
 
-	int n = readproc(pid, "stat", buf, sizeof(buf));
-	if (n <= 0)
-		return 0;
+	for (int i = 0; i < table.nmembers; ++i)
+		if (!show || show[table.members[i].group])
+			list[n++] = &table.members[i];
 
-	// Sighhh... firefox creates a (Web Content) entry
-	char *p = strchr(buf, ')');
-	if (!p)
-		return 0;
+	parallel(&unused, n, nthreads, fn, list);
+	free_procs(&unused);
+	free(list);
+}
 
-	for (int i = 0; i < 20; ++i) {
-		p = strchr(p, ' ');
-		if (!p)
-			return 0;
-		++p;
+/* -F: the groups nested under the groups that launched them. Sibling
+ * processes in the same group are folded into one node, so a fork
+ * storm shows up as one line with a big count. Everything here is
+ * linear in the number of pids.
+ */
+static int show_tree;
+
+struct tnode {
+	int group; /* index into table.procs */
+	int parent; /* -1 for the roots */
+	int count; /* processes in this node */
+	int procs; /* in the subtree */
+	unsigned long long cpu; /* subtree */
+	unsigned long rss; /* subtree */
+	pid_t pid; /* the lowest pid */
+	int first, next; /* children, in creation order */
+	char show;
+};
+
+/* An index + 1 hash keyed on two ints, zero is empty */
+static unsigned key_slot(unsigned *tab, unsigned mask, int a, int b,
+						 int (*key_eq)(int i, int a, int b))
+{
+	unsigned h = (a * 2654435761u) ^ (b * 0x9e3779b1u);
+
+	for (h &= mask; tab[h] && !key_eq(tab[h] - 1, a, b); h = (h + 1) & mask)
+		;
+	return h;
+}
+
+static struct tnode *tnodes;
+
+static int pid_eq(int i, int pid, int unused)
+{
+	return table.members[i].pid == pid;
+}
+
+static int tnode_eq(int i, int parent, int group)
+{
+	return tnodes[i].parent == parent && tnodes[i].group == group;
+}
+
+static void print_tnode(int i, int depth)
+{
+	struct tnode *n = &tnodes[i];
+	struct aproc *p = &table.procs[n->group];
+	unsigned long long secs = n->cpu / hz;
+	int cglen = by_cgroup ? strcspn(p->g.name, "\t") : 0;
+	const char *cmd = p->g.name[cglen] == '\t' ? p->g.name + cglen + 1 : p->g.name;
+
+	if (out_fmt) {
+		/* Flat, parent is the pid of the parent node or 0 */
+		json_open();
+		oprintf("\"pid\":%d,\"parent\":%d,\"depth\":%d,", n->pid,
+				n->parent >= 0 ? tnodes[n->parent].pid : 0, depth);
+		if (by_cgroup) {
+			ocat("\"cgroup\":");
+			ostr(p->g.name, p->g.name + cglen);
+			ocat(",");
+		}
+		ocat("\"cmd\":");
+		ostr(cmd, NULL);
+		oprintf(",\"count\":%d,\"procs\":%d", n->count, n->procs);
+		oprintf(",\"cpu\":%.2f", (double)n->cpu / hz);
+		oprintf(",\"rss\":%lu", n->rss * (pagesize / 1024));
+		json_close();
+	} else {
+		printf("%6d %3llu:%02llu:%02llu %8lu %*s%d %s", n->procs,
+			   secs / 3600, (secs / 60) % 60, secs % 60,
+			   n->rss * (pagesize / 1024), depth * 2, "", n->pid, cmd);
+		if (n->count > 1)
+			printf(" (%d)", n->count);
+		if (by_cgroup)
+			printf(" [%.*s]", cglen, p->g.name);
+		putchar('\n');
 	}
 
-	return strtol(p, NULL, 10);
+	for (int c = n->first; c >= 0; c = tnodes[c].next)
+		if (tnodes[c].show)
+			print_tnode(c, depth + 1);
 }
 
-static int add_proc(pid_t pid)
+static void print_tree(const char *show)
 {
-	static int maxproc;
-	struct aproc *p;
+	int n = table.nmembers;
+	unsigned size = 2;
 
-	if (pid == me) return 0;
+	while (size < n * 2)
+		size *= 2;
+	unsigned *tab = xcalloc(size, sizeof(unsigned));
+	int *start = xcalloc(n + 1, sizeof(int));
+	int *kids = xrealloc(NULL, (n + 1) * sizeof(int));
+	int *parent = xrealloc(NULL, (n + 1) * sizeof(int));
+	int *order = xrealloc(NULL, (n + 1) * sizeof(int));
+	int *node = xrealloc(NULL, (n + 1) * sizeof(int));
+	tnodes = xrealloc(NULL, (n + 1) * sizeof(struct tnode));
 
-	char buf[0x1001];
-	int n = readproccmdline(pid, buf, sizeof(buf));
-	if (n <= 0) {
-		if (n < 0)
-			fprintf(stderr, "%d: readproc failed\n", pid);
-		return 0;
+	/* pid -> member, then the children of each member as a CSR
+	 * index: the children of i are kids[start[i]] to kids[start[i + 1]].
+	 */
+	for (int i = 0; i < n; ++i)
+		tab[key_slot(tab, size - 1, table.members[i].pid, 0, pid_eq)] = i + 1;
+	for (int i = 0; i < n; ++i) {
+		unsigned h = key_slot(tab, size - 1, table.members[i].ppid, 0, pid_eq);
+		parent[i] = tab[h] ? tab[h] - 1 : -1;
+		if (parent[i] >= 0)
+			++start[parent[i] + 1];
 	}
+	for (int i = 0; i < n; ++i)
+		start[i + 1] += start[i];
+	int *fill = xrealloc(NULL, (n + 1) * sizeof(int));
+	memcpy(fill, start, n * sizeof(int));
+	for (int i = 0; i < n; ++i)
+		if (parent[i] >= 0)
+			kids[fill[parent[i]]++] = i;
+	free(fill);
 
-	unsigned long long starttime = readstarttime(pid);
-	if (starttime == 0) {
-		fprintf(stderr, "%d: readstarttime failed\n", pid);
-		return 0;
+	/* Breadth first from the roots, so a parent always has its node
+	 * before its children look for theirs. A pid whose parent is
+	 * missing (a kernel thread, or pid 0) is a root.
+	 */
+	int norder = 0;
+	for (int i = 0; i < n; ++i)
+		if (parent[i] < 0)
+			order[norder++] = i;
+	for (int i = 0; i < norder; ++i)
+		for (int k = start[order[i]]; k < start[order[i] + 1]; ++k)
+			order[norder++] = kids[k];
+
+	/* Anything not reached is in a ppid loop, which a racing scan
+	 * can see. Make those roots.
+	 */
+	if (norder < n) {
+		char *seen = xcalloc(n, 1);
+		for (int i = 0; i < norder; ++i)
+			seen[order[i]] = 1;
+		for (int i = 0; i < n; ++i)
+			if (!seen[i]) {
+				parent[i] = -1;
+				int from = norder;
+				order[norder++] = i;
+				seen[i] = 1;
+				for (int j = from; j < norder; ++j)
+					for (int k = start[order[j]]; k < start[order[j] + 1]; ++k)
+						if (!seen[kids[k]]) {
+							seen[kids[k]] = 1;
+							order[norder++] = kids[k];
+						}
+			}
+		free(seen);
 	}
 
-	/* /bin/sh is a special case */
-	char *cmd = buf;
-	if (strncmp(cmd, "/bin/sh", 7) == 0) {
-		if (*(cmd + 7)) {
-#if 1
-			// This drops the /bin/sh
-			cmd += 8;
-#else
-			// This keeps the /bin/sh
-			char *ptr = strchr(cmd + 8, ' ');
-			if (ptr) *ptr = 0;
-#endif
+	/* Fold each pid into the node for (parent's node, group) */
+	memset(tab, 0, size * sizeof(unsigned));
+	int nnodes = 0, first_root = -1, last_root = -1;
+	int *last = xrealloc(NULL, (n + 1) * sizeof(int));
+	for (int i = 0; i < norder; ++i) {
+		struct member *m = &table.members[order[i]];
+		int pnode = parent[order[i]] >= 0 ? node[parent[order[i]]] : -1;
+		unsigned h = key_slot(tab, size - 1, pnode, m->group, tnode_eq);
+		if (!tab[h]) {
+			struct tnode *t = &tnodes[nnodes];
+			*t = (struct tnode){ .group = m->group, .parent = pnode,
+								 .pid = m->pid, .first = -1, .next = -1 };
+			last[nnodes] = -1;
+			if (pnode < 0) {
+				if (last_root >= 0)
+					tnodes[last_root].next = nnodes;
+				else
+					first_root = nnodes;
+				last_root = nnodes;
+			} else {
+				if (last[pnode] >= 0)
+					tnodes[last[pnode]].next = nnodes;
+				else
+					tnodes[pnode].first = nnodes;
+				last[pnode] = nnodes;
+			}
+			tab[h] = ++nnodes;
 		}
-	} else {
-		char *ptr = strchr(cmd, ' ');
-		if (ptr) *ptr = 0;
-	}
-
-	p = procs;
-	for (int i = 0; i < curproc; ++i, ++p)
-		if (strcmp(cmd, p->cmd) == 0) {
-			++p->count;
-			if (pid < p->pid)
-				p->pid = pid;
-			if (starttime < p->time)
-				p->time = starttime;
-			return 0;
+		struct tnode *t = &tnodes[tab[h] - 1];
+		if (m->pid < t->pid)
+			t->pid = m->pid;
+		++t->count;
+		++t->procs;
+		t->cpu += m->cpu;
+		t->rss += m->rss;
+		node[order[i]] = tab[h] - 1;
+	}
+	free(last);
+
+	/* Nodes are created parents first, so one backwards pass sums
+	 * the subtrees. A node is shown if it, or anything under it,
+	 * matched.
+	 */
+	for (int i = nnodes - 1; i >= 0; --i) {
+		struct tnode *t = &tnodes[i];
+		t->show |= !show || show[t->group];
+		if (t->parent >= 0) {
+			struct tnode *p = &tnodes[t->parent];
+			p->procs += t->procs;
+			p->cpu += t->cpu;
+			p->rss += t->rss;
+			p->show |= t->show;
 		}
+	}
 
-	if (curproc >= maxproc) {
-		maxproc += 10;
-		procs = realloc(procs, maxproc * sizeof(struct aproc));
-		if (!procs) {
-			fputs("Out of memory!", stderr);
-			exit(1);
+	if (out_fmt)
+		print_header();
+	else
+		puts(" PROCS     TIME      RSS CMD");
+	for (int i = first_root; i >= 0; i = tnodes[i].next)
+		if (tnodes[i].show)
+			print_tnode(i, 0);
+
+	free(tab);
+	free(start);
+	free(kids);
+	free(parent);
+	free(order);
+	free(node);
+	free(tnodes);
+}
+
+/* -k and --wait-exit. The member pids of the shown groups are pinned
+ * with pidfds, so a pid that is reused after the scan is never
+ * signalled, and the exits are waited for with poll() rather than by
+ * rescanning /proc.
+ */
+static int kill_sig;
+static double wait_exit = -1; /* seconds, -1 to not wait */
+
+static const struct {
+	const char *name;
+	int sig;
+} signames[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+	{ "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+	{ "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+};
+
+/* TERM, SIGTERM, or 15. Returns -1 if unknown. */
+static int parse_signal(const char *str)
+{
+	if (isdigit(*str)) {
+		char *end;
+		long sig = strtol(str, &end, 10);
+		return *end || sig < 1 || sig >= NSIG ? -1 : sig;
+	}
+
+	if (strncasecmp(str, "SIG", 3) == 0)
+		str += 3;
+	for (int i = 0; i < sizeof(signames) / sizeof(signames[0]); ++i)
+		if (strcasecmp(str, signames[i].name) == 0)
+			return signames[i].sig;
+	return -1;
+}
+
+/* Returns the number of processes still running after the wait */
+static int signal_wait(const char *show)
+{
+	struct pollfd *fds = xrealloc(NULL, (table.nmembers + 1) * sizeof(struct pollfd));
+	int n = 0;
+
+	for (int i = 0; i < table.nmembers; ++i) {
+		struct member *m = &table.members[i];
+		if (show && !show[m->group])
+			continue;
+
+		int fd = syscall(SYS_pidfd_open, m->pid, 0);
+		if (fd < 0)
+			continue; /* already gone */
+
+		/* The pid may have been reused since the scan. The pidfd
+		 * pins it now, so checking the start time once is enough.
+		 */
+		char buf[MYPS_STATLEN];
+		struct myps_stat st;
+		if (myps_readproc(ctx, m->pid, "stat", buf, sizeof(buf)) <= 0 ||
+			myps_parse_stat(buf, &st) || st.starttime != m->starttime) {
+			close(fd);
+			continue;
+		}
+
+		if (kill_sig && syscall(SYS_pidfd_send_signal, fd, kill_sig, NULL, 0)) {
+			if (errno != ESRCH)
+				fprintf(stderr, "myps: %d: %s\n", m->pid, strerror(errno));
+			close(fd);
+			continue;
+		}
+
+		fds[n].fd = fd;
+		fds[n].events = POLLIN;
+		++n;
+	}
+
+	/* A pidfd polls readable once the process exits */
+	int running = n;
+	uint64_t end = now_ns() + wait_exit * 1e9;
+	while (wait_exit >= 0 && running > 0) {
+		uint64_t now = now_ns();
+		int ms = now < end ? (end - now + 999999) / 1000000 : 0;
+		int rc = poll(fds, n, ms);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (rc == 0)
+			break;
+		for (int i = 0; i < n; ++i)
+			if (fds[i].fd >= 0 && fds[i].revents) {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				--running;
+			}
+	}
+
+	for (int i = 0; i < n; ++i)
+		if (fds[i].fd >= 0)
+			close(fds[i].fd);
+	free(fds);
+
+	if (wait_exit >= 0 && running)
+		fprintf(stderr, "myps: %d processes still running\n", running);
+	return running;
+}
+
+/* pid -> group map for -e. Linear probing with backward shift
+ * deletion, pid 0 is empty.
+ */
+struct pmap {
+	pid_t pid;
+	int group; /* index into table.procs */
+	unsigned long long starttime;
+};
+
+static struct pmap *pmap;
+static unsigned pmap_size, pmap_count; /* size is always a power of 2 */
+
+static struct pmap *pmap_find(pid_t pid)
+{
+	if (!pmap_size)
+		return NULL;
+
+	for (unsigned h = pid & (pmap_size - 1); pmap[h].pid;
+		 h = (h + 1) & (pmap_size - 1))
+		if (pmap[h].pid == pid)
+			return &pmap[h];
+
+	return NULL;
+}
+
+static void pmap_add(pid_t pid, int group, unsigned long long starttime)
+{
+	if (pmap_count * 2 >= pmap_size) {
+		struct pmap *old = pmap;
+		unsigned old_size = pmap_size;
+
+		pmap_size = pmap_size ? pmap_size * 2 : 4096;
+		pmap = xcalloc(pmap_size, sizeof(struct pmap));
+		pmap_count = 0;
+		for (unsigned i = 0; i < old_size; ++i)
+			if (old[i].pid)
+				pmap_add(old[i].pid, old[i].group, old[i].starttime);
+		free(old);
+	}
+
+	unsigned h = pid & (pmap_size - 1);
+	while (pmap[h].pid)
+		h = (h + 1) & (pmap_size - 1);
+	pmap[h].pid = pid;
+	pmap[h].group = group;
+	pmap[h].starttime = starttime;
+	++pmap_count;
+}
+
+static void pmap_del(struct pmap *e)
+{
+	unsigned mask = pmap_size - 1;
+	unsigned i = e - pmap, j = i;
+
+	/* Shift back any entries that probed past the hole */
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!pmap[j].pid)
+			break;
+		unsigned h = pmap[j].pid & mask;
+		if (i <= j ? (i < h && h <= j) : (i < h || h <= j))
+			continue;
+		pmap[i] = pmap[j];
+		i = j;
+	}
+
+	pmap[i].pid = 0;
+	--pmap_count;
+}
+
+/* Remove a pid from its group. If it was the lowest pid or the oldest,
+ * the group has to be recomputed from the map.
+ */
+static void ungroup(struct pmap *e)
+{
+	struct aproc *p = &table.procs[e->group];
+	int group = e->group;
+	int recalc = e->pid == p->g.pid || e->starttime == p->g.starttime;
+
+	pmap_del(e);
+	if (--p->g.count == 0 || !recalc)
+		return;
+
+	int found = 0;
+	for (unsigned i = 0; i < pmap_size; ++i)
+		if (pmap[i].pid && pmap[i].group == group) {
+			if (!found || pmap[i].pid < p->g.pid)
+				p->g.pid = pmap[i].pid;
+			if (!found || pmap[i].starttime < p->g.starttime)
+				p->g.starttime = pmap[i].starttime;
+			found = 1;
 		}
+}
+
+static struct aproc *track(pid_t pid)
+{
+	struct myps_stat st;
+	struct aproc *p = add_proc(&table, pid, &st);
+
+	if (p)
+		pmap_add(pid, p - table.procs, st.starttime);
+	return p;
+}
+
+static void track_all(void)
+{
+	const pid_t *pids;
+	int npids = read_pids(&pids);
+
+	for (int i = 0; i < npids; ++i)
+		if (!pmap_find(pids[i]))
+			track(pids[i]);
+
+}
+
+static void show_change(int what, pid_t pid, const struct aproc *p)
+{
+	if (npatterns && !is_match(p))
+		return;
+
+	if (out_fmt) {
+		/* Always ndjson, the stream has no end */
+		oprintf("{\"event\":\"%c\",\"pid\":%d,\"cmd\":", what, pid);
+		ostr(p->g.name, NULL);
+		oprintf(",\"count\":%d}\n", p->g.count);
+		oflush();
+	} else {
+		printf("%c %5d %s (%d)\n", what, pid, p->g.name, p->g.count);
+		fflush(stdout);
 	}
-	p = &procs[curproc++];
-	p->cmd = strdup(cmd);
-	if (!p->cmd) {
-		fputs("Out of memory.", stderr);
+}
+
+static int cn_listen(void)
+{
+	int sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (sock < 0)
+		return -1;
+
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = CN_IDX_PROC,
+	};
+	if (bind(sock, (struct sockaddr *)&sa, sizeof(sa)))
+		goto failed;
+
+	/* A fork storm can easily overflow the default */
+	int size = 4 << 20;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	struct {
+		struct nlmsghdr nl;
+		struct cn_msg cn;
+		enum proc_cn_mcast_op op;
+	} __attribute__((packed)) msg = {
+		.nl.nlmsg_len = sizeof(msg),
+		.nl.nlmsg_type = NLMSG_DONE,
+		.cn.id.idx = CN_IDX_PROC,
+		.cn.id.val = CN_VAL_PROC,
+		.cn.len = sizeof(enum proc_cn_mcast_op),
+		.op = PROC_CN_MCAST_LISTEN,
+	};
+	if (send(sock, &msg, sizeof(msg), 0) != sizeof(msg))
+		goto failed;
+
+	return sock;
+
+failed:
+	close(sock);
+	return -1;
+}
+
+/* -e: one scan, then keep the table current from the proc connector */
+static void events(void)
+{
+	/* Listen first so nothing is missed during the scan. Events for
+	 * pids the scan already saw are ignored.
+	 */
+	int sock = cn_listen();
+	if (sock < 0) {
+		perror("proc connector");
 		exit(1);
 	}
-	p->count = 1;
-	p->pid = pid;
-	p->time = starttime;
+
+	track_all();
+
+	int ngroups;
+	struct aproc **sorted = sort_groups(&ngroups, NULL);
+	print_header();
+	for (int i = 0; i < ngroups; ++i)
+		if (npatterns)
+			do_match(sorted[i]);
+		else
+			print_proc(sorted[i]);
+	print_footer();
+	free(sorted);
+
+	char buf[0x2000] __attribute__((aligned(NLMSG_ALIGNTO)));
+	for (;;) {
+		int n = recv(sock, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				/* We lost events, start over */
+				fputs("myps: event overflow, rescanning\n", stderr);
+				for (int i = 0; i < table.curproc; ++i)
+					table.procs[i].g.count = 0;
+				memset(pmap, 0, pmap_size * sizeof(struct pmap));
+				pmap_count = 0;
+				track_all();
+				continue;
+			}
+			perror("recv");
+			exit(1);
+		}
+
+		for (struct nlmsghdr *nl = (struct nlmsghdr *)buf; NLMSG_OK(nl, n);
+			 nl = NLMSG_NEXT(nl, n)) {
+			struct cn_msg *cn = NLMSG_DATA(nl);
+			struct proc_event *ev = (struct proc_event *)cn->data;
+			struct aproc *p;
+			struct pmap *e;
+			pid_t pid;
+
+			if (nl->nlmsg_type != NLMSG_DONE || cn->id.idx != CN_IDX_PROC)
+				continue;
+
+			switch (ev->what) {
+			case PROC_EVENT_FORK:
+				pid = ev->event_data.fork.child_pid;
+				if (pid != ev->event_data.fork.child_tgid)
+					break; /* new thread */
+				if (!pmap_find(pid) && (p = track(pid)))
+					show_change('+', pid, p);
+				break;
+			case PROC_EVENT_EXEC:
+				pid = ev->event_data.exec.process_tgid;
+				if ((e = pmap_find(pid))) {
+					p = &table.procs[e->group];
+					ungroup(e);
+					show_change('-', pid, p);
+				}
+				if ((p = track(pid)))
+					show_change('+', pid, p);
+				break;
+			case PROC_EVENT_EXIT:
+				pid = ev->event_data.exit.process_pid;
+				if (pid != ev->event_data.exit.process_tgid)
+					break; /* thread exit */
+				if ((e = pmap_find(pid))) {
+					p = &table.procs[e->group];
+					ungroup(e);
+					show_change('-', pid, p);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+/* -d publishes the table in shared memory: a header, the groups, and
+ * then the strings. The daemon bumps seq to odd before changing
+ * anything and back to even when done. Readers copy everything out and
+ * retry if seq changed under them.
+ */
+#define SHM_NAME "/myps"
+#define SHM_MAGIC 0x7370796d /* myps */
+#define SHM_VERSION 1
+
+struct shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	int32_t pid; /* of the daemon */
+	uint64_t size; /* of the segment */
+	uint64_t updated_ms; /* CLOCK_BOOTTIME */
+	uint32_t period_ms;
+	uint32_t ngroups;
+	uint64_t strsize;
+};
+
+struct shm_proc {
+	uint64_t cmd; /* offset into the strings */
+	int32_t count;
+	int32_t pid;
+	uint64_t time;
+	uint64_t cpu;
+	uint64_t rss;
+	int32_t threads;
+	int32_t pad;
+};
+
+static struct shm_hdr *shm;
+static size_t shm_len;
+static volatile sig_atomic_t done;
+
+static void on_signal(int sig)
+{
+	done = 1;
+}
+
+static int shm_publish(int fd, double period)
+{
+	int ngroups;
+	struct aproc **sorted = sort_groups(&ngroups, NULL);
+
+	size_t strsize = 0;
+	for (int i = 0; i < ngroups; ++i)
+		strsize += strlen(sorted[i]->g.name) + 1;
+
+	size_t size = sizeof(struct shm_hdr) + ngroups * sizeof(struct shm_proc) + strsize;
+	if (size > shm_len) {
+		/* The segment never shrinks, readers remap if it grew */
+		size_t len = shm_len ? shm_len : 0x10000;
+		while (len < size)
+			len *= 2;
+		if (shm)
+			__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+		if (ftruncate(fd, len))
+			goto failed;
+		void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			goto failed;
+		if (shm)
+			munmap(shm, shm_len);
+		else
+			memset(p, 0, sizeof(struct shm_hdr));
+		shm = p;
+		shm_len = len;
+	}
+
+	uint32_t seq = shm->seq | 1;
+	__atomic_store_n(&shm->seq, seq, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	struct shm_proc *sp = (struct shm_proc *)(shm + 1);
+	char *strs = (char *)(sp + ngroups);
+	size_t off = 0;
+	for (int i = 0; i < ngroups; ++i, ++sp) {
+		struct aproc *p = sorted[i];
+		size_t len = strlen(p->g.name) + 1;
+		memcpy(strs + off, p->g.name, len);
+		sp->cmd = off;
+		off += len;
+		sp->count = p->g.count;
+		sp->pid = p->g.pid;
+		sp->time = p->g.starttime;
+		sp->cpu = p->g.cpu;
+		sp->rss = p->g.rss;
+		sp->threads = p->g.threads;
+	}
+
+	shm->magic = SHM_MAGIC;
+	shm->version = SHM_VERSION;
+	shm->pid = me;
+	shm->size = shm_len;
+	shm->updated_ms = boottime() * 1000;
+	shm->period_ms = period * 1000;
+	shm->ngroups = ngroups;
+	shm->strsize = strsize;
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELEASE);
+	free(sorted);
 	return 0;
+
+failed:
+	free(sorted);
+	return -1;
 }
 
-static int proc_cmp(const void *a, const void *b)
+/* -d: rescan every period seconds and publish the table. Stays in
+ * the foreground.
+ */
+static void publish(double period)
 {
-	const struct aproc *a1 = a;
-	const struct aproc *b1 = b;
+	int fd = shm_open(SHM_NAME, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(SHM_NAME);
+		exit(1);
+	}
+
+	/* Do not publish into a segment someone else planted */
+	struct stat sbuf;
+	if (fstat(fd, &sbuf) || sbuf.st_uid != geteuid()) {
+		fprintf(stderr, "myps: %s is not ours\n", SHM_NAME);
+		exit(1);
+	}
+	fchmod(fd, 0644);
+
+	/* Only one daemon at a time */
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		fputs("myps: daemon already running\n", stderr);
+		exit(1);
+	}
+
+	/* Never shrink a segment left behind by an old daemon, a reader
+	 * may still have it mapped.
+	 */
+	if (fstat(fd, &sbuf) == 0 && sbuf.st_size >= sizeof(struct shm_hdr)) {
+		void *p = mmap(NULL, sbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) {
+			shm = p;
+			shm_len = sbuf.st_size;
+		}
+	}
+
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	raise_nofile();
+
+	const pid_t *pids;
+	double last = boottime();
+	while (!done) {
+		int npids = read_pids(&pids);
+		refresh(pids, npids, last * hz);
+		last = boottime();
+
+		if (shm_publish(fd, period)) {
+			perror(SHM_NAME);
+			break;
+		}
 
-	if (a1->time == b1->time)
-		return a1->pid < b1->pid ? -1 : 1;
-	return ((struct aproc *)a)->time < ((struct aproc *)b)->time ? -1 : 1;
+		sleep_for(period);
+	}
+
+	shm_unlink(SHM_NAME);
+	exit(done ? 0 : 1);
 }
 
-int do_match(const struct aproc *p, const char *match, int word)
+/* Copy the daemon's table into table. Returns 0 on success, or -1 if
+ * there is no usable daemon and we need to scan ourselves.
+ */
+static int shm_read(void)
 {
-	char *ptr = strstr(p->cmd, match);
-	if (ptr == NULL)
-		return 0;
+	int fd = shm_open(SHM_NAME, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
 
-	if (word) {
-		if (!(ptr == p->cmd || *(ptr - 1) == '/'))
-			return 0; // mismatch at start
-		ptr += strlen(match);
-		if (*ptr)
-			return 0; // mismatch at end
+	/* Anyone can create the segment. Only trust one from root or
+	 * ourselves that nobody else can write.
+	 */
+	struct stat sbuf;
+	if (fstat(fd, &sbuf) || (sbuf.st_uid != 0 && sbuf.st_uid != geteuid()) ||
+		(sbuf.st_mode & (S_IWGRP | S_IWOTH))) {
+		close(fd);
+		return -1;
 	}
 
-	if (p->count > 1)
-		printf("%5d %s (%d)\n", p->pid, p->cmd, p->count);
-	else
-		printf("%5d %s\n", p->pid, p->cmd);
+	char *copy = NULL;
+	void *map = MAP_FAILED;
+	size_t len = 0;
+	int rc = -1;
 
-	return 1;
+	for (int tries = 0; tries < 100; ++tries) {
+		if (fstat(fd, &sbuf) || sbuf.st_size < sizeof(struct shm_hdr))
+			break;
+		if (map == MAP_FAILED || sbuf.st_size != len) {
+			if (map != MAP_FAILED)
+				munmap(map, len);
+			len = sbuf.st_size;
+			map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				break;
+		}
+
+		struct shm_hdr *hdr = map;
+		uint32_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		if (hdr->size != len)
+			continue; /* it grew */
+
+		free(copy);
+		copy = xrealloc(NULL, len);
+		memcpy(copy, map, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		/* We have a consistent copy, now see if it is usable */
+		hdr = (struct shm_hdr *)copy;
+		if (hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION ||
+			sizeof(struct shm_hdr) + hdr->ngroups * sizeof(struct shm_proc) +
+			hdr->strsize > len)
+			break;
+		if (kill(hdr->pid, 0) && errno == ESRCH)
+			break; /* daemon died */
+		if (boottime() * 1000 - hdr->updated_ms > 2 * hdr->period_ms + 1000)
+			break; /* too stale */
+
+		struct shm_proc *sp = (struct shm_proc *)(hdr + 1);
+		char *strs = (char *)(sp + hdr->ngroups);
+		if (hdr->strsize)
+			strs[hdr->strsize - 1] = 0;
+		for (unsigned i = 0; i < hdr->ngroups; ++i, ++sp) {
+			if (sp->cmd >= hdr->strsize)
+				continue;
+			if (sp->count == 1 && sp->pid == me)
+				continue; /* we never list ourselves */
+			struct aproc one = {
+				.g.count = sp->count,
+				.g.pid = sp->pid,
+				.g.starttime = sp->time,
+				.g.cpu = sp->cpu,
+				.g.rss = sp->rss,
+				.g.threads = sp->threads,
+			};
+			group(lookup(&table, strs + sp->cmd, NULL), &one);
+		}
+
+		stats.daemon = hdr->pid;
+		rc = 0;
+		break;
+	}
+
+	if (map != MAP_FAILED)
+		munmap(map, len);
+	free(copy);
+	close(fd);
+	return rc;
+}
+
+static void usage(int rc)
+{
+	fputs("usage: myps [-cCeFlNrSTuw] [-j threads] [-s key] [-t secs [-n count]]\n"
+		  "            [-o json|ndjson] [-f file] [--proc-root dir] [match ...]\n"
+		  "       myps [-k signal] [--wait-exit secs] match ...\n"
+		  "       myps [--save file] [--record file [-t secs]]\n"
+		  "       myps --diff file file [match ...]\n"
+		  "       myps -d secs\n"
+		  "where: -w match whole command name\n"
+		  "       -f read match patterns from file, one per line\n"
+		  "       -r match patterns are extended regular expressions\n"
+		  "       -l long listing with the summed TIME, RSS (k), and threads\n"
+		  "       -s sort by start (default), cpu, rss, threads, count, wait, io,\n"
+		  "          fds, or pss\n"
+		  "       -j scan /proc with this many threads. -T, --fds, and --pss\n"
+		  "          default to one per CPU\n"
+		  "       -u use io_uring to read /proc (if available)\n"
+		  "       -S, --stats report scan statistics and phase times to stderr\n"
+		  "       -t top mode, refresh every secs with %CPU and RSS changes\n"
+		  "       -n stop after count refreshes\n"
+		  "       -e follow process events, printing group changes (root)\n"
+		  "       -d run as a daemon publishing the table every secs\n"
+		  "       -N always scan /proc, even if a daemon is running\n"
+		  "       -c group by cgroup, with the cgroup v2 counters\n"
+		  "       -C like -c, but also list the commands in each cgroup\n"
+		  "       -o output a json array, or one json object per line\n"
+		  "       -F, --tree nest the groups under their parents, with subtree\n"
+		  "          process counts, TIME, and RSS (k). With -o each node has\n"
+		  "          its depth and the pid of its parent node\n"
+		  "       -T show the thread count and CPU time per thread name\n"
+		  "       --max-threads limit -T to this many threads per process\n"
+		  "       --proc-root use dir rather than /proc (implies -N)\n"
+		  "       --sched show the schedstat CPU and run queue wait (s) and timeslices,\n"
+		  "          with -t the run queue wait in ms per second\n"
+		  "       --io show the disk read and write (k) and read/write syscalls,\n"
+		  "          with -t per second\n"
+		  "       --numa show the NUMA nodes and CPUs each group last ran on, the\n"
+		  "          allowed CPUs and memory nodes, and ! if it spans nodes\n"
+		  "       --pss show the proportional (PSS) and unshared (USS) memory and\n"
+		  "          swap (k) from smaps_rollup, best with a match\n"
+		  "       --fds count the open files, sockets, pipes, and other fds\n"
+		  "       --save write the table to file\n"
+		  "       --record append the table to a ring file, every -t secs if given\n"
+		  "       --ring-size the --record ring size in MB (default 64)\n"
+		  "       --diff show the groups that came, went, or changed count between\n"
+		  "          two --save or --record files, each file or file@time\n"
+		  "       -k send signal (TERM, 15, ...) to every process in the matched groups\n"
+		  "       --wait-exit wait up to secs for the matched processes to exit\n"
+		  "\nIf a daemon is running, the table is read from it.\n"
+		  "\nThe exit status is the number of patterns that matched nothing, or 126\n"
+		  "if --wait-exit timed out.\n",
+		  stderr);
+	exit(rc);
 }
 
 int main(int argc, char *argv[])
 {
-	int c, word = 0, rc = 0;
-	const char *match = NULL;
+	int c, nthreads = 0, show_stats = 0, iterations = 0, follow = 0;
+	int no_daemon = 0, rc = 0;
+	const char *diff_from = NULL, *diff_to = NULL;
+	double period = 0;
+	const char *proc_root = "/proc";
+	uint64_t start;
+
+	enum {
+		OPT_PROC_ROOT = 256, OPT_MAX_THREADS, OPT_WAIT_EXIT, OPT_SCHED, OPT_IO,
+		OPT_FDS, OPT_SAVE, OPT_RECORD, OPT_RING_SIZE, OPT_DIFF, OPT_NUMA,
+		OPT_PSS
+	};
+	static const struct option long_opts[] = {
+		{ "proc-root", required_argument, NULL, OPT_PROC_ROOT },
+		{ "max-threads", required_argument, NULL, OPT_MAX_THREADS },
+		{ "stats", no_argument, NULL, 'S' },
+		{ "tree", no_argument, NULL, 'F' },
+		{ "wait-exit", required_argument, NULL, OPT_WAIT_EXIT },
+		{ "sched", no_argument, NULL, OPT_SCHED },
+		{ "io", no_argument, NULL, OPT_IO },
+		{ "fds", no_argument, NULL, OPT_FDS },
+		{ "numa", no_argument, NULL, OPT_NUMA },
+		{ "pss", no_argument, NULL, OPT_PSS },
+		{ "save", required_argument, NULL, OPT_SAVE },
+		{ "record", required_argument, NULL, OPT_RECORD },
+		{ "ring-size", required_argument, NULL, OPT_RING_SIZE },
+		{ "diff", required_argument, NULL, OPT_DIFF },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL }
+	};
 
-	while ((c = getopt(argc, argv, "w")) != EOF)
-		if (c == 'w')
+	while ((c = getopt_long(argc, argv, "cCd:ef:Fhj:k:ln:No:rs:St:Tuw", long_opts, NULL)) != EOF)
+		switch (c) {
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			if (nthreads < 1)
+				usage(1);
+			break;
+		case 'l':
+			long_fmt = 1;
+			break;
+		case 'n':
+			iterations = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			sort_key = -1;
+			for (int i = 0; i < sizeof(sort_keys) / sizeof(char *); ++i)
+				if (strcmp(optarg, sort_keys[i]) == 0)
+					sort_key = i;
+			if (sort_key == -1) {
+				fprintf(stderr, "Invalid sort key %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 'S':
+			show_stats = 1;
+			stats.timing = 1;
+			break;
+		case 't':
+			interval = strtod(optarg, NULL);
+			if (interval <= 0)
+				usage(1);
+			break;
+		case 'u':
+			use_uring = 1;
+			break;
+		case 'w':
 			word = 1;
+			break;
+		case 'e':
+			follow = 1;
+			break;
+		case 'd':
+			period = strtod(optarg, NULL);
+			if (period <= 0)
+				usage(1);
+			break;
+		case 'N':
+			no_daemon = 1;
+			break;
+		case 'f':
+			if (read_patterns(optarg))
+				exit(2);
+			break;
+		case 'r':
+			use_regex = 1;
+			break;
+		case 'c':
+			by_cgroup = 1;
+			break;
+		case 'C':
+			by_cgroup = 2;
+			break;
+		case 'k':
+			kill_sig = parse_signal(optarg);
+			if (kill_sig < 0) {
+				fprintf(stderr, "myps: unknown signal %s\n", optarg);
+				exit(2);
+			}
+			want_members = 1;
+			break;
+		case OPT_SAVE:
+			save_file = optarg;
+			break;
+		case OPT_RECORD:
+			record_file = optarg;
+			break;
+		case OPT_RING_SIZE:
+			ring_size = strtoull(optarg, NULL, 0) << 20;
+			if (ring_size < 1 << 20)
+				usage(1);
+			break;
+		case OPT_DIFF:
+			diff_from = optarg;
+			break;
+		case OPT_PSS:
+			show_pss = 1;
+			want_members = 1;
+			break;
+		case OPT_NUMA:
+			show_numa = 1;
+			no_daemon = 1;
+			break;
+		case OPT_FDS:
+			show_fds = 1;
+			want_members = 1;
+			break;
+		case OPT_IO:
+			show_io = 1;
+			no_daemon = 1;
+			break;
+		case OPT_SCHED:
+			show_sched = 1;
+			no_daemon = 1;
+			break;
+		case OPT_WAIT_EXIT:
+			wait_exit = strtod(optarg, NULL);
+			if (wait_exit < 0)
+				usage(1);
+			want_members = 1;
+			break;
+		case 'o':
+			for (out_fmt = 0; strcmp(optarg, out_fmts[out_fmt]); )
+				if (++out_fmt == sizeof(out_fmts) / sizeof(char *))
+					usage(1);
+			break;
+		case 'F':
+			show_tree = 1;
+			want_members = 1;
+			break;
+		case 'T':
+			show_threads = 1;
+			want_members = 1;
+			break;
+		case OPT_MAX_THREADS:
+			max_threads = strtol(optarg, NULL, 0);
+			break;
+		case OPT_PROC_ROOT:
+			proc_root = optarg;
+			no_daemon = 1;
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(1);
+		}
+
+	/* --diff A B */
+	if (diff_from) {
+		if (optind >= argc)
+			usage(1);
+		diff_to = argv[optind++];
+	}
 
-	if (optind < argc) {
-		match = argv[optind];
-		rc = 1;
+	while (optind < argc)
+		add_pattern(argv[optind++]);
+	if (sort_key < 0)
+		sort_key = interval ? SORT_CPU : SORT_START;
+	if (compile_patterns())
+		exit(2);
+	/* Top mode and the daemon group on the command only */
+	if (by_cgroup && (interval || period)) {
+		fputs("myps: -c does not work with -t or -d\n", stderr);
+		exit(2);
+	}
+	/* They only keep the group sums, not the members or the table */
+	if ((interval || period) && (show_tree || show_threads || show_fds ||
+								 show_pss || show_numa || save_file)) {
+		fputs("myps: -F, -T, --fds, --pss, --numa and --save do not work with -t or -d\n",
+			  stderr);
+		exit(2);
+	}
+	if ((kill_sig || wait_exit >= 0) && !npatterns) {
+		fputs("myps: -k and --wait-exit need a match\n", stderr);
+		exit(2);
+	}
+	/* Top mode, -e and the daemon never get to the signal */
+	if ((kill_sig || wait_exit >= 0) && (interval || follow || period)) {
+		fputs("myps: -k and --wait-exit do not work with -t, -e or -d\n", stderr);
+		exit(2);
 	}
 
 	me = getpid();
+	pagesize = sysconf(_SC_PAGESIZE);
+	hz = sysconf(_SC_CLK_TCK);
 
-	DIR *dir = opendir("/proc");
-	if (!dir) {
-		perror("/proc");
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	boot_epoch = ts.tv_sec + ts.tv_nsec / 1e9 - boottime();
+	if (follow && out_fmt)
+		out_fmt = OUT_NDJSON;
+
+	if (diff_from) {
+		diff(diff_from, diff_to);
+		return report_patterns();
+	}
+	if (record_file)
+		rec_open();
+	if (show_numa)
+		numa_init();
+
+	ctx = myps_open(proc_root);
+	if (!ctx) {
+		perror(proc_root);
 		exit(1);
 	}
+	procfd = myps_procfd(ctx);
 
-	struct dirent *ent;
-	while ((ent = readdir(dir))) {
-		char *e;
-		pid_t pid = strtol(ent->d_name, &e, 10);
-		if (*e == 0)
-			add_proc(pid);
+	if (interval) {
+		top(iterations);
+		return 0;
 	}
 
-	qsort(procs, curproc, sizeof(struct aproc), proc_cmp);
+	if (follow)
+		events();
 
-	struct aproc *p;
-	int i;
-	for (p = procs, i = 0; i < curproc; ++i, ++p) {
-		if (match) {
-			if (do_match(p, match, word))
-				rc = 0;
-		} else if (p->count > 1)
-			printf("%5d %s (%d)\n", p->pid, p->cmd, p->count);
+	if (period)
+		publish(period);
+
+	/* The daemon does not know about cgroups or pids */
+	if (no_daemon || by_cgroup || want_members || shm_read()) {
+		const pid_t *pids;
+		start = now_ns();
+		int npids = read_pids(&pids);
+		stats.ns[T_LIST] = now_ns() - start;
+		start = now_ns();
+		scan(pids, npids, nthreads ? nthreads : 1);
+		stats.ns[T_SCAN] = now_ns() - start;
+	}
+
+	if (save_file || record_file) {
+		if (save_file)
+			save();
+		if (record_file)
+			record();
+		free_procs(&table);
+		return 0;
+	}
+
+	/* Match first, so the per pid reads below are only done for the
+	 * shown groups. show is indexed like table.procs.
+	 */
+	char *show = NULL;
+	start = now_ns();
+	if (npatterns) {
+		show = xcalloc(table.curproc + 1, 1);
+		for (int i = 0; i < table.curproc; ++i) {
+			struct aproc p = table.procs[i];
+			if (by_cgroup) /* match the command, not the cgroup */
+				p.g.name = strchr(p.g.name, '\t') + 1;
+			show[i] = is_match(&p);
+		}
+	}
+	stats.ns[T_MATCH] = now_ns() - start;
+
+	/* The per-pid reads below are mostly waiting on the kernel, so
+	 * they default to a thread per CPU.
+	 */
+	int readers = nthreads;
+	if (!readers && (readers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		readers = 1;
+
+	if (show_threads) {
+		start = now_ns();
+		read_tasks(&tasks, show, readers);
+		stats.ns[T_TASKS] = now_ns() - start;
+	}
+
+	if (show_fds) {
+		start = now_ns();
+		for_members(show, readers, read_fd_dir);
+		stats.ns[T_FDS] = now_ns() - start;
+	}
+
+	if (show_pss) {
+		start = now_ns();
+		for_members(show, readers, read_rollup);
+		stats.ns[T_PSS] = now_ns() - start;
+	}
+
+	/* Sort through pointers so the member group indices stay valid */
+	start = now_ns();
+	int ngroups;
+	struct aproc **sorted = sort_groups(&ngroups, NULL);
+	stats.ns[T_SORT] = now_ns() - start;
+
+	start = now_ns();
+	if (show_tree)
+		print_tree(show);
+	else if (by_cgroup)
+		print_cgroups(sorted, ngroups, show);
+	else {
+		print_header();
+		for (int i = 0; i < ngroups; ++i)
+			if (!show || show[sorted[i] - table.procs])
+				print_proc(sorted[i]);
+	}
+	print_footer();
+	free(sorted);
+	free_procs(&tasks);
+
+	if (npatterns)
+		rc = report_patterns();
+	stats.ns[T_PRINT] = now_ns() - start;
+
+	if (kill_sig || wait_exit >= 0) {
+		start = now_ns();
+		if (signal_wait(show) && wait_exit >= 0)
+			rc = 126;
+		stats.ns[T_WAIT] = now_ns() - start;
+	}
+	free(show);
+
+	if (show_stats) {
+		unsigned long long bytes;
+		unsigned long syscalls = total_syscalls(&bytes);
+		if (stats.daemon)
+			fprintf(stderr, "myps: %d groups from daemon %d\n",
+					table.curproc, stats.daemon);
 		else
-			printf("%5d %s\n", p->pid, p->cmd);
+			fprintf(stderr, "myps: %d pids, %d groups, %d kernel threads, %d exited\n"
+					"myps: %lu syscalls, %llu bytes read\n",
+					stats.pids, table.curproc, stats.kthreads, stats.races,
+					syscalls, bytes);
+		fputs("myps:", stderr);
+		for (int i = 0; i < sizeof(phases) / sizeof(char *); ++i)
+			if (stats.ns[i] || i == T_SCAN)
+				fprintf(stderr, " %s %.3f ms", phases[i], stats.ns[i] / 1e6);
+		fputc('\n', stderr);
+
+		struct rusage ru;
+		if (getrusage(RUSAGE_SELF, &ru) == 0)
+			fprintf(stderr, "myps: peak rss %ld KB\n", ru.ru_maxrss);
 	}
 
+	free_procs(&table);
 	return rc;
 }
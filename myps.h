@@ -0,0 +1,170 @@
+#ifndef MYPS_H
+#define MYPS_H
+
+/* libmyps: the /proc scanning and grouping behind myps, for programs
+ * that want to keep one scanner around rather than run myps and parse
+ * its output.
+ *
+ * Everything hangs off a struct myps context, so separate contexts can
+ * be used from separate threads. A context is not thread safe itself.
+ */
+
+#include <sys/types.h>
+
+/* /proc/<pid>/stat is well under this */
+#define MYPS_STATLEN 512
+/* /proc/<pid>/cmdline is limited to 4k */
+#define MYPS_CMDLEN 0x1001
+
+/* Big enough to list most /proc dirs in one getdents64 call */
+#define MYPS_DENTSLEN 0x40000
+
+/* From linux/sched.h, in myps_stat.flags */
+#define MYPS_PF_KTHREAD 0x00200000
+
+/* The parts of /proc/<pid>/stat we care about. See proc(5) for the
+ * field numbers.
+ */
+struct myps_stat {
+	char state;			/*  3 */
+	pid_t ppid;			/*  4 */
+	unsigned flags;		/*  9 */
+	unsigned long long utime;	/* 14 */
+	unsigned long long stime;	/* 15 */
+	int num_threads;	/* 20 */
+	unsigned long long starttime; /* 22 */
+	unsigned long vsize;	/* 23 */
+	unsigned long rss;	/* 24 */
+	int processor;		/* 39 */
+};
+
+/* One process. The strings are only valid until the next call on the
+ * context.
+ */
+struct myps_proc {
+	pid_t pid;
+	const char *cmdline; /* the arguments separated by spaces */
+	const char *name; /* what myps groups on */
+	struct myps_stat stat;
+};
+
+/* A group of processes with the same name */
+struct myps_group {
+	const char *name;
+	int count;
+	pid_t pid; /* the lowest */
+	unsigned long long starttime; /* the oldest, in ticks since boot */
+	unsigned long long cpu; /* utime + stime in ticks */
+	unsigned long rss; /* pages */
+	int threads;
+};
+
+/* start sorts oldest first, the others biggest first */
+enum {
+	MYPS_SORT_START, MYPS_SORT_CPU, MYPS_SORT_RSS, MYPS_SORT_THREADS,
+	MYPS_SORT_COUNT
+};
+
+/* A name to index hash for grouping. The caller keeps the groups in
+ * an array of its own, in the order the names were added, so index i
+ * in the table is element i of the array. The names are interned in
+ * the table.
+ */
+struct myps_table {
+	struct myps_key {
+		const char *name;
+		unsigned hash;
+	} *keys;
+	int n, max;
+	unsigned *hashtab; /* open addressed, index + 1, zero is empty */
+	unsigned hashsize; /* always a power of 2 */
+	struct myps_arena *arena;
+};
+
+struct myps;
+
+/* proc_root is normally "/proc". Returns NULL with errno set on error. */
+struct myps *myps_open(const char *proc_root);
+void myps_close(struct myps *m);
+/* The open proc_root, for reading other files under it */
+int myps_procfd(struct myps *m);
+/* The syscalls made and bytes read by the context so far */
+void myps_counts(struct myps *m, unsigned long *syscalls,
+				 unsigned long long *bytes);
+
+/* List the pids. Returns the number of pids, or -1 on error. The list
+ * is valid until the next myps_pids or myps_rewind.
+ */
+int myps_pids(struct myps *m, const pid_t **pids);
+
+/* Iterate over the processes, skipping kernel threads and the caller.
+ * myps_rewind() starts a new pass over a fresh listing. myps_next()
+ * returns 1 with the next process, 0 at the end, or -1 on error.
+ */
+int myps_rewind(struct myps *m);
+int myps_next(struct myps *m, struct myps_proc *p);
+
+/* Call fn for every process. Stops early if fn returns non-zero and
+ * returns that value, otherwise returns 0, or -1 on error.
+ */
+int myps_foreach(struct myps *m,
+				 int (*fn)(const struct myps_proc *p, void *arg), void *arg);
+
+/* Scan and group the processes. Returns the number of groups, or -1 on
+ * error. The groups are valid until the next myps_scan or myps_close.
+ */
+int myps_scan(struct myps *m);
+const struct myps_group *myps_groups(struct myps *m, int sort, int *ngroups);
+
+/* The building blocks, also used by myps itself. myps_readproc and
+ * myps_readcmdline may be called from several threads at once.
+ */
+
+/* Reads /proc/<pid>/<file> into buf and NUL terminates it. Returns the
+ * length read, or -1.
+ */
+int myps_readproc(struct myps *m, pid_t pid, const char *file, char *buf, int len);
+/* The same for cmdline, with the arguments separated by spaces */
+int myps_readcmdline(struct myps *m, pid_t pid, char *buf, int len);
+/* Reads the stat of pid into p, and then its cmdline into buf unless
+ * it is a kernel thread. p->name is left for the caller to cut out of
+ * p->cmdline. Returns 1 if p is a process to group, 0 for the caller,
+ * a kernel thread, or a zombie with no cmdline, or -1 if it could not
+ * be read, usually because it exited.
+ */
+int myps_read(struct myps *m, pid_t pid, struct myps_proc *p, char *buf, int len);
+/* Call fn for each numbered entry of the open dir fd, like the pids in
+ * /proc or the fds in /proc/<pid>/fd, reading from the current offset
+ * through buf. Stops early if fn returns non-zero and returns that
+ * value, otherwise returns 0, or -1 on error.
+ */
+int myps_readdir(struct myps *m, int fd, char *buf, int len,
+				 int (*fn)(const char *name, void *arg), void *arg);
+
+/* Returns the index of name in t, adding it as index t->n if it is
+ * new, or -1 on error. If name is already interned (merging), pass it
+ * as interned and it will not be copied.
+ */
+int myps_lookup(struct myps_table *t, const char *name, const char *interned);
+/* Hand the names interned in src over to dst */
+void myps_table_move(struct myps_table *dst, struct myps_table *src);
+/* Forget the names, keeping the hash for reuse */
+void myps_table_clear(struct myps_table *t);
+void myps_table_free(struct myps_table *t);
+
+/* Add the process p, or the group src, to g */
+void myps_group_proc(struct myps_group *g, const struct myps_proc *p);
+void myps_group_add(struct myps_group *g, const struct myps_group *src);
+/* The qsort order for a MYPS_SORT key, ties go to the oldest */
+int myps_group_cmp(const struct myps_group *a, const struct myps_group *b, int sort);
+
+/* Parses the whole stat line in one pass. Returns 0 on success. */
+int myps_parse_stat(const char *buf, struct myps_stat *st);
+/* cmdline has NULs between the arguments, turn them into spaces */
+void myps_cmdline_spaces(char *buf, int n);
+/* The group name from a cmdline, truncating it in place */
+char *myps_cmd_name(char *cmd);
+/* FNV-1a, also returning the length */
+unsigned myps_hash(const char *str, size_t *len);
+
+#endif
@@ -0,0 +1,145 @@
+/* apitest - check the libmyps API against a tree from mkfakeproc
+ *
+ * usage: apitest dir pids groups kthreads, with the mkfakeproc -p, -g
+ * and -k that built dir.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "myps.h"
+
+static int fails;
+
+#define CHECK(cond)														\
+	do {																\
+		if (!(cond)) {													\
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);	\
+			++fails;													\
+		}																\
+	} while (0)
+
+struct sums {
+	int procs;
+	unsigned long long cpu;
+	unsigned long rss;
+	int threads;
+};
+
+static int add_proc(const struct myps_proc *p, void *arg)
+{
+	struct sums *s = arg;
+
+	CHECK(!(p->stat.flags & MYPS_PF_KTHREAD));
+	CHECK(strncmp(p->cmdline, p->name, strlen(p->name)) == 0);
+	CHECK(!strchr(p->name, ' '));
+	++s->procs;
+	s->cpu += p->stat.utime + p->stat.stime;
+	s->rss += p->stat.rss;
+	s->threads += p->stat.num_threads;
+	return 0;
+}
+
+static int stop(const struct myps_proc *p, void *arg)
+{
+	return ++*(int *)arg == 3 ? 42 : 0;
+}
+
+static void check_groups(struct myps *m, int n, const struct sums *want)
+{
+	for (int sort = MYPS_SORT_START; sort <= MYPS_SORT_COUNT; ++sort) {
+		struct sums got = { 0 };
+		int ngroups;
+		const struct myps_group *g = myps_groups(m, sort, &ngroups);
+
+		CHECK(ngroups == n);
+		for (int i = 0; i < ngroups; ++i) {
+			got.procs += g[i].count;
+			got.cpu += g[i].cpu;
+			got.rss += g[i].rss;
+			got.threads += g[i].threads;
+			if (i)
+				CHECK(myps_group_cmp(&g[i - 1], &g[i], sort) < 0);
+			for (int j = 0; j < i; ++j)
+				CHECK(strcmp(g[i].name, g[j].name));
+		}
+		CHECK(got.procs == want->procs);
+		CHECK(got.cpu == want->cpu);
+		CHECK(got.rss == want->rss);
+		CHECK(got.threads == want->threads);
+	}
+}
+
+static void check_table(void)
+{
+	struct myps_table t = { 0 };
+
+	CHECK(myps_lookup(&t, "a", NULL) == 0);
+	CHECK(myps_lookup(&t, "b", NULL) == 1);
+	CHECK(myps_lookup(&t, "a", NULL) == 0);
+	CHECK(t.n == 2 && strcmp(t.keys[1].name, "b") == 0);
+
+	/* Enough to rehash */
+	char name[16];
+	for (int i = 0; i < 5000; ++i) {
+		snprintf(name, sizeof(name), "n%d", i);
+		CHECK(myps_lookup(&t, name, NULL) == i + 2);
+	}
+	CHECK(myps_lookup(&t, "n1234", NULL) == 1236);
+
+	myps_table_clear(&t);
+	CHECK(t.n == 0 && myps_lookup(&t, "b", NULL) == 0);
+	myps_table_free(&t);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 5) {
+		fputs("usage: apitest dir pids groups kthreads\n", stderr);
+		return 2;
+	}
+	int npids = strtol(argv[2], NULL, 10);
+	int ngroups = strtol(argv[3], NULL, 10);
+	int kthreads = strtol(argv[4], NULL, 10);
+
+	struct myps *m = myps_open(argv[1]);
+	if (!m) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	/* mkfakeproc adds kthreadd. We are skipped if our pid is one of
+	 * the fake processes.
+	 */
+	const pid_t *pids;
+	CHECK(myps_pids(m, &pids) == npids + kthreads + 1);
+	char buf[MYPS_CMDLEN];
+	if (myps_readcmdline(m, getpid(), buf, sizeof(buf)) > 0)
+		--npids;
+
+	struct sums want = { 0 };
+	CHECK(myps_foreach(m, add_proc, &want) == 0);
+	CHECK(want.procs == npids);
+	int calls = 0;
+	CHECK(myps_foreach(m, stop, &calls) == 42 && calls == 3);
+
+	/* The second scan reuses the table */
+	for (int pass = 0; pass < 2; ++pass) {
+		int n = myps_scan(m);
+		CHECK(n > 0 && n <= ngroups);
+		check_groups(m, n, &want);
+	}
+
+	unsigned long syscalls;
+	unsigned long long bytes;
+	myps_counts(m, &syscalls, &bytes);
+	CHECK(syscalls > 0 && bytes > 0);
+	myps_close(m);
+
+	check_table();
+
+	if (fails)
+		fprintf(stderr, "apitest: %d checks failed\n", fails);
+	return fails != 0;
+}